@@ -0,0 +1,390 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <unistd.h>
+#include "mygit.h"
+using namespace std;
+using namespace mygit;
+namespace fs = std::filesystem;
+
+// Benchmark driver: builds a deterministic synthetic repository, times the
+// library operations cold and warm over several repetitions and prints the
+// results as JSON on stdout (and a table on stderr).
+
+struct BenchOptions {
+    size_t files = 2000;
+    size_t min_size = 256;
+    size_t max_size = 256 << 10;  // sizes are log-uniform in [min, max]
+    size_t depth = 3;
+    size_t fanout = 4;  // subdirectories per directory
+    size_t commits = 20;
+    double churn = 0.02;  // fraction of files changed per commit
+    size_t reps = 5;
+    uint64_t seed = 1;
+    size_t jobs = 0;
+    string fsync = "batch";
+    string dir;
+    bool keep = false;
+};
+
+// splitmix64: same seed, same repository on every machine
+class Random {
+public:
+    explicit Random(uint64_t seed) : state(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+private:
+    uint64_t state;
+};
+
+struct Sample {
+    double cold_ms;
+    double warm_ms;
+};
+
+struct OpResult {
+    string name;
+    string unit;  // what `items` counts
+    uint64_t items = 0;
+    uint64_t bytes = 0;
+    vector<Sample> samples;
+};
+
+static double nowMs() {
+    return chrono::duration<double, milli>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double timeMs(const function<void()>& op) {
+    double start = nowMs();
+    op();
+    return nowMs() - start;
+}
+
+// Evicts the page cache so cold runs really hit the disk; needs root, so
+// the report says whether it happened
+static bool dropPageCache() {
+    sync();
+    ofstream drop("/proc/sys/vm/drop_caches");
+    drop << "3\n";
+    drop.flush();
+    return bool(drop);
+}
+
+// Mostly text-like lines, so compression sees realistic input
+static string fileContent(Random& rng, size_t length) {
+    static const char* words[] = {"int", "return", "value", "mygit", "object", "tree",
+                                  "commit", "index", "const", "for", "while", "{", "}", ";"};
+    string content;
+    content.reserve(length + 16);
+    while (content.size() < length) {
+        size_t n = 1 + rng.next() % 10;
+        for (size_t i = 0; i < n; i++) {
+            content += words[rng.next() % size(words)];
+            content += ' ';
+        }
+        content += to_string(rng.next() % 100000);
+        content += '\n';
+    }
+    content.resize(length);
+    return content;
+}
+
+static size_t fileSize(Random& rng, const BenchOptions& opts) {
+    double lo = log(double(opts.min_size)), hi = log(double(opts.max_size));
+    return size_t(exp(lo + (hi - lo) * rng.uniform()));
+}
+
+static void writeFile(const string& path, const string& content) {
+    ofstream out(path, ios::binary | ios::trunc);
+    out.write(content.data(), content.size());
+    if (!out) throw runtime_error("Failed to write " + path);
+}
+
+// Spreads files over a tree of `depth` levels with `fanout` directories each
+static vector<string> generateTree(Random& rng, const BenchOptions& opts, uint64_t& total_bytes) {
+    vector<string> dirs = {""};
+    for (size_t level = 0, first = 0; level < opts.depth; level++) {
+        size_t last = dirs.size();
+        for (size_t d = first; d < last; d++) {
+            for (size_t f = 0; f < opts.fanout; f++) {
+                string dir = dirs[d] + "d" + to_string(f) + "/";
+                fs::create_directories(dir);
+                dirs.push_back(dir);
+            }
+        }
+        first = last;
+    }
+
+    vector<string> files;
+    total_bytes = 0;
+    for (size_t i = 0; i < opts.files; i++) {
+        string path = dirs[rng.next() % dirs.size()] + "f" + to_string(i) + ".txt";
+        string content = fileContent(rng, fileSize(rng, opts));
+        total_bytes += content.size();
+        writeFile(path, content);
+        files.push_back(path);
+    }
+    return files;
+}
+
+static void modifyFiles(Random& rng, const vector<string>& files, double fraction) {
+    size_t count = max<size_t>(1, size_t(files.size() * fraction));
+    for (size_t i = 0; i < count; i++) {
+        const string& path = files[rng.next() % files.size()];
+        ofstream out(path, ios::binary | ios::app);
+        out << "change " << rng.next() << "\n";
+    }
+}
+
+static uint64_t treeBytes(const vector<string>& files) {
+    uint64_t total = 0;
+    for (const auto& path : files) total += fs::file_size(path);
+    return total;
+}
+
+static void touchAll(const vector<string>& files) {
+    for (const auto& path : files) {
+        fs::last_write_time(path, fs::file_time_type::clock::now());
+    }
+}
+
+static void writeConfig(const BenchOptions& opts) {
+    ofstream config(".mygit/config", ios::app);
+    config << "[core]\n\tfsyncObjects = " << opts.fsync << "\n";
+}
+
+static unique_ptr<Repository> openRepository(const BenchOptions& opts) {
+    auto repo = make_unique<Repository>();
+    repo->setJobs(opts.jobs);
+    return repo;
+}
+
+static double percentile(vector<double> values, double p) {
+    sort(values.begin(), values.end());
+    size_t rank = size_t(ceil(p / 100.0 * values.size()));
+    return values[min(values.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+static string jsonStats(const vector<double>& values, const OpResult& op) {
+    double mean = 0;
+    for (double v : values) mean += v;
+    mean /= values.size();
+    double p50 = percentile(values, 50);
+
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "{\"min_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f, "
+             "\"mean_ms\": %.3f, \"%s_per_s\": %.1f, \"mb_per_s\": %.2f}",
+             percentile(values, 0), p50, percentile(values, 90), percentile(values, 99),
+             percentile(values, 100), mean, op.unit.c_str(), p50 > 0 ? op.items / (p50 / 1000) : 0.0,
+             p50 > 0 ? op.bytes / 1048576.0 / (p50 / 1000) : 0.0);
+    return buf;
+}
+
+static void usage() {
+    cerr << "Usage: mygit-bench [--files N] [--min-size B] [--max-size B] [--depth D] [--fanout F]\n"
+            "                   [--commits C] [--churn FRACTION] [--reps R] [--seed S] [-j N]\n"
+            "                   [--fsync none|object|batch] [--dir PATH] [--keep]\n";
+}
+
+static BenchOptions parseOptions(int argc, char* argv[]) {
+    BenchOptions opts;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        auto value = [&]() -> string {
+            if (i + 1 >= argc) throw runtime_error("Missing value for " + arg);
+            return argv[++i];
+        };
+        if (arg == "--files") opts.files = stoul(value());
+        else if (arg == "--min-size") opts.min_size = stoul(value());
+        else if (arg == "--max-size") opts.max_size = stoul(value());
+        else if (arg == "--depth") opts.depth = stoul(value());
+        else if (arg == "--fanout") opts.fanout = stoul(value());
+        else if (arg == "--commits") opts.commits = stoul(value());
+        else if (arg == "--churn") opts.churn = stod(value());
+        else if (arg == "--reps") opts.reps = stoul(value());
+        else if (arg == "--seed") opts.seed = stoull(value());
+        else if (arg == "-j") opts.jobs = stoul(value());
+        else if (arg == "--fsync") opts.fsync = value();
+        else if (arg == "--dir") opts.dir = value();
+        else if (arg == "--keep") opts.keep = true;
+        else {
+            usage();
+            throw runtime_error("Unknown option: " + arg);
+        }
+    }
+    if (opts.files == 0 || opts.reps == 0 || opts.min_size == 0 || opts.min_size > opts.max_size) {
+        throw runtime_error("Need --files, --reps and --min-size > 0 and --min-size <= --max-size");
+    }
+    return opts;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        BenchOptions opts = parseOptions(argc, argv);
+        string dir = opts.dir;
+        if (dir.empty()) {
+            string tmpl = (fs::temp_directory_path() / "mygit-bench-XXXXXX").string();
+            if (!mkdtemp(tmpl.data())) throw runtime_error("Cannot create benchmark directory");
+            dir = tmpl;
+        } else {
+            fs::create_directories(dir);
+        }
+        fs::path original = fs::current_path();
+        fs::current_path(dir);
+
+        Random rng(opts.seed);
+        uint64_t total_bytes;
+        vector<string> files = generateTree(rng, opts, total_bytes);
+        bool dropped = false;
+
+        OpResult add{"add", "files", files.size(), total_bytes, {}};
+        OpResult write_tree{"writeTree", "files", files.size(), total_bytes, {}};
+        OpResult commit{"commit", "files", files.size(), total_bytes, {}};
+        OpResult read{"readObject", "objects", 0, 0, {}};
+        OpResult log{"log", "commits", 0, 0, {}};
+        OpResult checkout{"checkout", "files", files.size(), total_bytes, {}};
+
+        for (size_t rep = 0; rep < opts.reps; rep++) {
+            // Commits append to files, so later repetitions see a little more data
+            total_bytes = treeBytes(files);
+            add.bytes = write_tree.bytes = commit.bytes = checkout.bytes = total_bytes;
+
+            // add: cold into an empty object store, warm with every file in
+            // the stat cache
+            fs::remove_all(".mygit");
+            openRepository(opts)->init();
+            writeConfig(opts);
+            dropped = dropPageCache();
+            auto repo = openRepository(opts);
+            Sample s;
+            s.cold_ms = timeMs([&] { repo->add({"."}); });
+            s.warm_ms = timeMs([&] { repo->add({"."}); });
+            add.samples.push_back(s);
+
+            // writeTree: cold after touching every file (all re-hashed, no
+            // object written), warm with nothing changed
+            touchAll(files);
+            repo = openRepository(opts);
+            s.cold_ms = timeMs([&] { repo->writeTree(); });
+            s.warm_ms = timeMs([&] { repo->writeTree(); });
+            write_tree.samples.push_back(s);
+
+            // commit: cold with `churn` of the files edited, warm with none.
+            // The history for log and checkout is built the same way.
+            Random history(opts.seed + 1);
+            for (size_t c = 0; c + 1 < opts.commits; c++) {
+                modifyFiles(history, files, opts.churn);
+                repo->commit("history " + to_string(c));
+            }
+            modifyFiles(history, files, opts.churn);
+            repo = openRepository(opts);
+            s.cold_ms = timeMs([&] { repo->commit("cold"); });
+            s.warm_ms = timeMs([&] { repo->commit("warm"); });
+            commit.samples.push_back(s);
+
+            // readObject: every blob of HEAD, with a fresh object cache and
+            // then again with it populated
+            vector<string> blobs;
+            function<void(const string&)> collect = [&](const string& tree) {
+                for (const auto& entry : repo->readTree(tree)) {
+                    if (entry.isTree()) collect(entry.hex());
+                    else blobs.push_back(entry.hex());
+                }
+            };
+            collect(string(repo->readCommit(repo->head()).tree()));
+            dropped = dropPageCache() && dropped;
+            repo = openRepository(opts);
+            uint64_t read_bytes = 0;
+            s.cold_ms = timeMs([&] {
+                for (const auto& sha : blobs) read_bytes += repo->read(sha).size();
+            });
+            s.warm_ms = timeMs([&] {
+                for (const auto& sha : blobs) repo->read(sha);
+            });
+            read.items = blobs.size();
+            read.bytes = read_bytes;
+            read.samples.push_back(s);
+
+            // log: the whole history through a fresh repository, then again
+            uint64_t commits = 0;
+            repo = openRepository(opts);
+            s.cold_ms = timeMs([&] {
+                repo->log("", [&](const string&, const CommitView&) { commits++; return true; });
+            });
+            s.warm_ms = timeMs([&] {
+                repo->log("", [&](const string&, const CommitView&) { return true; });
+            });
+            log.items = commits;
+            log.samples.push_back(s);
+
+            // checkout: from HEAD back to the first commit, then forward
+            // again with the objects cached
+            string head = repo->head(), first;
+            repo->revList("", [&](const string& sha) { first = sha; return true; });
+            repo = openRepository(opts);
+            s.cold_ms = timeMs([&] { repo->checkout(first); });
+            s.warm_ms = timeMs([&] { repo->checkout(head); });
+            checkout.samples.push_back(s);
+        }
+
+        fs::current_path(original);
+        if (!opts.keep) fs::remove_all(dir);
+
+        cout << "{\n  \"config\": {\"files\": " << opts.files << ", \"bytes\": " << total_bytes
+             << ", \"min_size\": " << opts.min_size << ", \"max_size\": " << opts.max_size
+             << ", \"depth\": " << opts.depth << ", \"fanout\": " << opts.fanout
+             << ", \"commits\": " << opts.commits << ", \"churn\": " << opts.churn
+             << ", \"reps\": " << opts.reps << ", \"seed\": " << opts.seed << ", \"jobs\": " << opts.jobs
+             << ", \"fsync\": \"" << opts.fsync << "\", \"page_cache_dropped\": "
+             << (dropped ? "true" : "false") << "},\n  \"results\": [\n";
+
+        char line[160];
+        snprintf(line, sizeof(line), "%-12s %8s %12s %12s %12s %12s\n", "operation", "run", "p50 ms",
+                 "p90 ms", "max ms", "MB/s");
+        cerr << line;
+        vector<const OpResult*> ops = {&add, &write_tree, &commit, &read, &log, &checkout};
+        for (size_t i = 0; i < ops.size(); i++) {
+            const OpResult& op = *ops[i];
+            vector<double> cold, warm;
+            for (const auto& sample : op.samples) {
+                cold.push_back(sample.cold_ms);
+                warm.push_back(sample.warm_ms);
+            }
+            cout << "    {\"op\": \"" << op.name << "\", \"items\": " << op.items << ", \"bytes\": " << op.bytes
+                 << ",\n     \"cold\": " << jsonStats(cold, op) << ",\n     \"warm\": " << jsonStats(warm, op)
+                 << "}" << (i + 1 < ops.size() ? "," : "") << "\n";
+
+            for (const auto& [run, values] : {pair{"cold", &cold}, pair{"warm", &warm}}) {
+                double p50 = percentile(*values, 50);
+                snprintf(line, sizeof(line), "%-12s %8s %12.2f %12.2f %12.2f %12.1f\n", op.name.c_str(), run,
+                         p50, percentile(*values, 90), percentile(*values, 100),
+                         p50 > 0 ? op.bytes / 1048576.0 / (p50 / 1000) : 0.0);
+                cerr << line;
+            }
+        }
+        cout << "  ]\n}\n";
+    } catch (const exception& e) {
+        cerr << "Error: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
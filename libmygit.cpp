@@ -0,0 +1,5867 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <filesystem>
+#include <ctime>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <zlib.h>
+#include "mygit.h"
+using namespace std;
+namespace fs = filesystem;
+
+namespace mygit {
+
+// Work-stealing thread pool. Each worker owns a deque: it takes its own work
+// from the back (most recently spawned, still cache-warm) and steals from the
+// front of other workers' deques when it runs dry.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads) {
+        threads = max<size_t>(threads, 1);
+        for (size_t i = 0; i < threads; i++) {
+            queues.push_back(make_unique<Queue>());
+        }
+        for (size_t i = 0; i < threads; i++) {
+            workers.emplace_back([this, i] { run(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+        }
+        work_cv.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const { return workers.size(); }
+
+    static bool inWorker() { return current_pool != nullptr; }
+
+    // Tasks submitted from a worker go to that worker's own deque
+    void submit(function<void()> task) {
+        size_t target = (current_pool == this) ? current_worker
+                                               : next_queue++ % queues.size();
+        pending++;
+        {
+            lock_guard<mutex> lock(queues[target]->m);
+            queues[target]->tasks.push_back(move(task));
+        }
+        {
+            lock_guard<mutex> lock(m);
+            queued++;
+        }
+        work_cv.notify_one();
+    }
+
+    // Blocks until every submitted task, including tasks spawned by other
+    // tasks, has finished. Rethrows the first exception a task raised.
+    void wait() {
+        unique_lock<mutex> lock(m);
+        done_cv.wait(lock, [this] { return pending == 0; });
+        if (error) {
+            exception_ptr e = error;
+            error = nullptr;
+            rethrow_exception(e);
+        }
+    }
+
+private:
+    struct Queue {
+        mutex m;
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<Queue>> queues;
+    vector<thread> workers;
+    mutex m;
+    condition_variable work_cv;
+    condition_variable done_cv;
+    size_t queued = 0;
+    bool stopping = false;
+    exception_ptr error;
+    atomic<size_t> pending{0};
+    atomic<size_t> next_queue{0};
+
+    static thread_local ThreadPool* current_pool;
+    static thread_local size_t current_worker;
+
+    bool takeTask(size_t self, function<void()>& task) {
+        {
+            Queue& own = *queues[self];
+            lock_guard<mutex> lock(own.m);
+            if (!own.tasks.empty()) {
+                task = move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++) {
+            Queue& victim = *queues[(self + i) % queues.size()];
+            lock_guard<mutex> lock(victim.m);
+            if (!victim.tasks.empty()) {
+                task = move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(size_t self) {
+        current_pool = this;
+        current_worker = self;
+        while (true) {
+            {
+                unique_lock<mutex> lock(m);
+                work_cv.wait(lock, [this] { return queued > 0 || stopping; });
+                if (queued == 0 && stopping) return;
+                queued--;
+            }
+
+            // A queued count was reserved above, so a task is guaranteed to
+            // be sitting in some deque
+            function<void()> task;
+            while (!takeTask(self, task)) {
+                this_thread::yield();
+            }
+
+            try {
+                task();
+            } catch (...) {
+                lock_guard<mutex> lock(m);
+                if (!error) error = current_exception();
+            }
+
+            if (--pending == 0) {
+                lock_guard<mutex> lock(m);
+                done_cv.notify_all();
+            }
+        }
+    }
+};
+
+thread_local ThreadPool* ThreadPool::current_pool = nullptr;
+thread_local size_t ThreadPool::current_worker = 0;
+
+// Counting limit on bytes in flight between pipeline stages. acquire()
+// blocks until the request fits, except that a request larger than the
+// whole budget is let through once nothing else is in flight.
+class ByteBudget {
+public:
+    explicit ByteBudget(uint64_t limit) : limit(limit) {}
+
+    void acquire(uint64_t bytes) {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&] { return in_flight == 0 || in_flight + bytes <= limit; });
+        in_flight += bytes;
+    }
+
+    void release(uint64_t bytes) {
+        {
+            lock_guard<mutex> lock(m);
+            in_flight -= bytes;
+        }
+        cv.notify_all();
+    }
+
+private:
+    mutex m;
+    condition_variable cv;
+    uint64_t limit;
+    uint64_t in_flight = 0;
+};
+
+// Hash backend on OpenSSL's EVP interface, which dispatches to the SHA-NI or
+// ARMv8 crypto instructions when the CPU has them. Digests are fetched once
+// per process and each thread keeps finished contexts for reuse, so hashing
+// a small object allocates nothing.
+class Hasher {
+public:
+    enum Algorithm { SHA1, SHA256 };
+
+    explicit Hasher(Algorithm algorithm = SHA1) : algorithm(algorithm) {
+        vector<EVP_MD_CTX*>& spare = spareContexts();
+        if (!spare.empty()) {
+            ctx = spare.back();
+            spare.pop_back();
+        } else {
+            ctx = EVP_MD_CTX_new();
+        }
+        if (!ctx || EVP_DigestInit_ex(ctx, digest(algorithm), nullptr) != 1) {
+            EVP_MD_CTX_free(ctx);
+            throw runtime_error("Hash initialization failed");
+        }
+    }
+
+    ~Hasher() {
+        vector<EVP_MD_CTX*>& spare = spareContexts();
+        if (spare.size() < MAX_SPARE) {
+            spare.push_back(ctx);
+        } else {
+            EVP_MD_CTX_free(ctx);
+        }
+    }
+
+    Hasher(const Hasher&) = delete;
+    Hasher& operator=(const Hasher&) = delete;
+
+    void update(const void* data, size_t len) { EVP_DigestUpdate(ctx, data, len); }
+
+    // Writes size() bytes
+    void finish(unsigned char* out) { EVP_DigestFinal_ex(ctx, out, nullptr); }
+
+    size_t size() const { return algorithm == SHA1 ? 20 : 32; }
+
+    static void hash(const void* data, size_t len, unsigned char* out, Algorithm algorithm = SHA1) {
+        Hasher hasher(algorithm);
+        hasher.update(data, len);
+        hasher.finish(out);
+    }
+
+private:
+    static constexpr size_t MAX_SPARE = 4;
+
+    struct ContextPool {
+        vector<EVP_MD_CTX*> contexts;
+        ~ContextPool() {
+            for (EVP_MD_CTX* ctx : contexts) EVP_MD_CTX_free(ctx);
+        }
+    };
+
+    Algorithm algorithm;
+    EVP_MD_CTX* ctx = nullptr;
+
+    static vector<EVP_MD_CTX*>& spareContexts() {
+        thread_local ContextPool pool;
+        return pool.contexts;
+    }
+
+    static const EVP_MD* digest(Algorithm algorithm) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        // An explicit fetch skips the provider lookup EVP_sha1() costs per init
+        static EVP_MD* sha1 = EVP_MD_fetch(nullptr, "SHA1", nullptr);
+        static EVP_MD* sha256 = EVP_MD_fetch(nullptr, "SHA256", nullptr);
+        return algorithm == SHA1 ? sha1 : sha256;
+#else
+        return algorithm == SHA1 ? EVP_sha1() : EVP_sha256();
+#endif
+    }
+};
+
+// A zlib deflate stream borrowed from a per-thread pool. deflateInit
+// allocates about 256 KB of window and hash tables, more than deflating a
+// small tree or commit costs, so streams are deflateReset between objects
+// instead of being rebuilt.
+class Deflater {
+public:
+    explicit Deflater(int level) {
+        vector<z_stream*>& spare = spareStreams();
+        if (!spare.empty()) {
+            strm = spare.back();
+            spare.pop_back();
+            deflateReset(strm);
+        } else {
+            strm = new z_stream{};
+            if (deflateInit(strm, level) != Z_OK) {
+                delete strm;
+                throw runtime_error("Compression initialization failed");
+            }
+        }
+        // No input yet, so this only switches parameters
+        if (deflateParams(strm, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+            release(strm);
+            throw runtime_error("Bad compression level " + to_string(level));
+        }
+    }
+
+    ~Deflater() {
+        vector<z_stream*>& spare = spareStreams();
+        if (spare.size() < MAX_SPARE) {
+            spare.push_back(strm);
+        } else {
+            release(strm);
+        }
+    }
+
+    Deflater(const Deflater&) = delete;
+    Deflater& operator=(const Deflater&) = delete;
+
+    z_stream& stream() { return *strm; }
+
+    // One-shot zlib stream of `data`
+    static string compress(string_view data, int level) {
+        Deflater deflater(level);
+        z_stream& zs = deflater.stream();
+        string compressed(deflateBound(&zs, data.size()), '\0');
+        zs.next_in = (Bytef*)data.data();
+        zs.avail_in = data.size();
+        zs.next_out = (Bytef*)compressed.data();
+        zs.avail_out = compressed.size();
+        if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+            throw runtime_error("Compression failed");
+        }
+        compressed.resize(compressed.size() - zs.avail_out);
+        return compressed;
+    }
+
+private:
+    static constexpr size_t MAX_SPARE = 2;
+
+    struct StreamPool {
+        vector<z_stream*> streams;
+        ~StreamPool() {
+            for (z_stream* strm : streams) release(strm);
+        }
+    };
+
+    z_stream* strm = nullptr;
+
+    static void release(z_stream* strm) {
+        deflateEnd(strm);
+        delete strm;
+    }
+
+    static vector<z_stream*>& spareStreams() {
+        thread_local StreamPool pool;
+        return pool.streams;
+    }
+};
+
+// Instrumentation behind MYGIT_TRACE. When it is unset every probe is a
+// single branch on a constant. MYGIT_TRACE=1 prints a summary to stderr at
+// exit; a value ending in ".json" writes Chrome trace-event JSON to that
+// path instead (open it in chrome://tracing or Perfetto).
+//
+// Phases record wall and thread CPU time and become trace events. Steps
+// (SHA-1 and deflate per buffer, inflate, fsync) are too frequent for a CPU
+// clock syscall each, so they only add up wall time.
+class Trace {
+public:
+    enum Counter {
+        OBJECTS_READ,
+        BYTES_INFLATED,
+        OBJECTS_HASHED,
+        BYTES_HASHED,
+        OBJECTS_WRITTEN,
+        BYTES_DEFLATED,
+        BYTES_WRITTEN,
+        OBJECT_CACHE_HITS,
+        OBJECT_CACHE_MISSES,
+        STAT_CACHE_HITS,
+        STAT_CACHE_MISSES,
+        KNOWN_OBJECT_HITS,
+        SYS_OPEN,
+        SYS_STAT,
+        SYS_FSYNC,
+        SYS_RENAME,
+        IO_OPS,
+        IO_URING_ENTERS,
+        BLOOM_NEGATIVES,
+        BLOOM_MAYBES,
+        BLOOM_FALSE_POSITIVES,
+        DELTA_BASE_HITS,
+        DELTA_BASE_MISSES,
+        COUNTER_COUNT
+    };
+
+    static inline const bool on = [] {
+        const char* value = getenv("MYGIT_TRACE");
+        return value && *value && strcmp(value, "0") != 0;
+    }();
+
+    static void count(Counter counter, uint64_t n = 1) {
+        if (on) counters[counter].fetch_add(n, memory_order_relaxed);
+    }
+
+    class Span {
+    public:
+        explicit Span(const char* name, bool phase = true) : name(on ? name : nullptr), phase(phase) {
+            if (!this->name) return;
+            start = wallNs();
+            if (phase) cpu_start = cpuNs();
+        }
+
+        ~Span() {
+            if (!name) return;
+            uint64_t wall = wallNs() - start;
+            uint64_t cpu = phase ? cpuNs() - cpu_start : 0;
+            instance().record(name, phase, start, wall, cpu);
+        }
+
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+    private:
+        const char* name;
+        bool phase;
+        uint64_t start = 0;
+        uint64_t cpu_start = 0;
+    };
+
+    ~Trace() {
+        try {
+            if (!json_path.empty()) {
+                writeJson();
+            } else {
+                writeSummary();
+            }
+        } catch (const exception& e) {
+            cerr << "Error: trace: " << e.what() << endl;
+        }
+    }
+
+private:
+    struct Totals {
+        const char* name;
+        bool phase;
+        uint64_t calls = 0;
+        uint64_t wall_ns = 0;
+        uint64_t cpu_ns = 0;
+    };
+
+    struct Event {
+        const char* name;
+        uint32_t tid;
+        uint64_t start_ns;
+        uint64_t wall_ns;
+        uint64_t cpu_ns;
+    };
+
+    static inline atomic<uint64_t> counters[COUNTER_COUNT];
+    static inline atomic<uint32_t> next_tid{0};
+
+    mutex m;
+    vector<Totals> totals;  // first-seen order
+    vector<Event> events;   // JSON mode only
+    string json_path;
+
+    Trace() {
+        string value = getenv("MYGIT_TRACE");
+        if (value.size() > 5 && value.compare(value.size() - 5, 5, ".json") == 0) json_path = value;
+    }
+
+    static Trace& instance() {
+        static Trace trace;
+        return trace;
+    }
+
+    static uint64_t wallNs() {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static uint64_t cpuNs() {
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+    }
+
+    static inline const uint64_t process_start = wallNs();
+
+    static uint32_t threadId() {
+        thread_local uint32_t tid = next_tid++;
+        return tid;
+    }
+
+    void record(const char* name, bool phase, uint64_t start, uint64_t wall, uint64_t cpu) {
+        uint32_t tid = threadId();
+        lock_guard<mutex> lock(m);
+        auto it = find_if(totals.begin(), totals.end(),
+                          [&](const Totals& t) { return strcmp(t.name, name) == 0; });
+        if (it == totals.end()) it = totals.insert(totals.end(), {name, phase});
+        it->calls++;
+        it->wall_ns += wall;
+        it->cpu_ns += cpu;
+        if (phase && !json_path.empty()) events.push_back({name, tid, start, wall, cpu});
+    }
+
+    static constexpr const char* COUNTER_NAMES[COUNTER_COUNT] = {
+        "objects_read", "bytes_inflated", "objects_hashed", "bytes_hashed",
+        "objects_written", "bytes_deflated", "bytes_written",
+        "object_cache_hits", "object_cache_misses", "stat_cache_hits", "stat_cache_misses",
+        "known_object_hits", "open", "stat", "fsync", "rename", "io_ops", "io_uring_enters",
+        "bloom_negatives", "bloom_maybes", "bloom_false_positives", "delta_base_hits", "delta_base_misses",
+    };
+
+    static uint64_t get(Counter counter) { return counters[counter].load(); }
+
+    // Read and write syscall totals of the whole process, from the kernel
+    static pair<uint64_t, uint64_t> ioSyscalls() {
+        ifstream io("/proc/self/io");
+        string key;
+        uint64_t value, reads = 0, writes = 0;
+        while (io >> key >> value) {
+            if (key == "syscr:") reads = value;
+            if (key == "syscw:") writes = value;
+        }
+        return {reads, writes};
+    }
+
+    static string rate(uint64_t hits, uint64_t misses) {
+        if (hits + misses == 0) return "-";
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%.1f%%", 100.0 * hits / (hits + misses));
+        return buf;
+    }
+
+    void writeSummary() {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        auto seconds = [](const timeval& tv) { return tv.tv_sec + tv.tv_usec / 1e6; };
+        auto [reads, writes] = ioSyscalls();
+
+        char line[160];
+        snprintf(line, sizeof(line), "trace: %.3f s wall, %.3f s user, %.3f s sys\n",
+                 (wallNs() - process_start) / 1e9, seconds(usage.ru_utime), seconds(usage.ru_stime));
+        cerr << line;
+
+        // Phase time on worker threads is summed, so it can exceed the wall total
+        snprintf(line, sizeof(line), "  %-20s %10s %12s %12s\n", "phase", "calls", "wall ms", "cpu ms");
+        cerr << line;
+        for (const auto& t : totals) {
+            string label = t.phase ? t.name : string(t.name) + " (step)";
+            if (t.phase) {
+                snprintf(line, sizeof(line), "  %-20s %10llu %12.1f %12.1f\n", label.c_str(),
+                         (unsigned long long)t.calls, t.wall_ns / 1e6, t.cpu_ns / 1e6);
+            } else {
+                snprintf(line, sizeof(line), "  %-20s %10llu %12.1f %12s\n", label.c_str(),
+                         (unsigned long long)t.calls, t.wall_ns / 1e6, "-");
+            }
+            cerr << line;
+        }
+
+        cerr << "  objects: " << get(OBJECTS_READ) << " read (" << get(BYTES_INFLATED) << " bytes inflated), "
+             << get(OBJECTS_HASHED) << " hashed (" << get(BYTES_HASHED) << " bytes), "
+             << get(OBJECTS_WRITTEN) << " written (" << get(BYTES_DEFLATED) << " bytes deflated to "
+             << get(BYTES_WRITTEN) << ")\n";
+        cerr << "  caches: object " << get(OBJECT_CACHE_HITS) << "/" << get(OBJECT_CACHE_MISSES) << " hit/miss ("
+             << rate(get(OBJECT_CACHE_HITS), get(OBJECT_CACHE_MISSES)) << "), stat " << get(STAT_CACHE_HITS)
+             << "/" << get(STAT_CACHE_MISSES) << " (" << rate(get(STAT_CACHE_HITS), get(STAT_CACHE_MISSES))
+             << "), delta bases " << get(DELTA_BASE_HITS) << "/" << get(DELTA_BASE_MISSES) << " ("
+             << rate(get(DELTA_BASE_HITS), get(DELTA_BASE_MISSES)) << "), known objects "
+             << get(KNOWN_OBJECT_HITS) << " hits\n";
+        if (get(BLOOM_NEGATIVES) + get(BLOOM_MAYBES)) {
+            cerr << "  bloom filters: " << get(BLOOM_NEGATIVES) << " commits skipped, " << get(BLOOM_MAYBES)
+                 << " diffed (" << get(BLOOM_FALSE_POSITIVES) << " false positives)\n";
+        }
+        cerr << "  syscalls: read " << reads << ", write " << writes << ", open " << get(SYS_OPEN) << ", stat "
+             << get(SYS_STAT) << ", fsync " << get(SYS_FSYNC) << ", rename " << get(SYS_RENAME)
+             << "; " << usage.ru_majflt << " major faults, " << usage.ru_nvcsw << " voluntary switches\n";
+        cerr << "  batched io: " << get(IO_OPS) << " ops in " << get(IO_URING_ENTERS) << " io_uring_enter calls\n";
+    }
+
+    void writeJson() {
+        ofstream out(json_path, ios::trunc);
+        if (!out) throw runtime_error("Cannot write " + json_path);
+
+        int pid = getpid();
+        char buf[256];
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        for (const auto& e : events) {
+            snprintf(buf, sizeof(buf),
+                     "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                     "\"args\":{\"cpu_ms\":%.3f}},\n",
+                     e.name, pid, e.tid, (e.start_ns - process_start) / 1e3, e.wall_ns / 1e3, e.cpu_ns / 1e6);
+            out << buf;
+        }
+
+        auto [reads, writes] = ioSyscalls();
+        out << "{\"name\":\"counters\",\"ph\":\"C\",\"pid\":" << pid << ",\"tid\":0,\"ts\":"
+            << (wallNs() - process_start) / 1000 << ",\"args\":{";
+        for (int c = 0; c < COUNTER_COUNT; c++) {
+            out << "\"" << COUNTER_NAMES[c] << "\":" << get(Counter(c)) << ",";
+        }
+        out << "\"read\":" << reads << ",\"write\":" << writes << "}}";
+
+        // Steps have no events of their own; their totals go in the metadata
+        for (const auto& t : totals) {
+            if (t.phase) continue;
+            out << ",\n{\"name\":\"" << t.name << "\",\"ph\":\"C\",\"pid\":" << pid
+                << ",\"tid\":0,\"ts\":" << (wallNs() - process_start) / 1000
+                << ",\"args\":{\"calls\":" << t.calls << ",\"wall_ms\":" << t.wall_ns / 1e6 << "}}";
+        }
+        out << "\n]}\n";
+    }
+};
+
+// One file operation of an IoBatch. `result` is what the syscall would
+// return (fd, byte count, 0) or -errno.
+struct IoOp {
+    enum Kind : uint8_t { OPEN, READ, WRITE, CLOSE, FSYNC, RENAME, STATX } kind;
+    int fd = -1;
+    int flags = 0;
+    mode_t mode = 0;
+    const char* path = nullptr;
+    const char* path2 = nullptr;  // RENAME target
+    void* buf = nullptr;          // READ/WRITE data, STATX result
+    size_t len = 0;
+    uint64_t offset = 0;
+    long result = 0;
+};
+
+// io_uring driven through the raw syscalls (no liburing). One ring per
+// thread, created on first use; forThread() returns null when the kernel
+// refuses io_uring or lacks one of the opcodes used here.
+class IoRing {
+public:
+    ~IoRing() {
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_len);
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_len);
+        if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_len);
+        if (fd >= 0) close(fd);
+    }
+
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+
+    static IoRing* forThread() {
+        static atomic<bool> unavailable{false};
+        thread_local unique_ptr<IoRing> ring;
+        thread_local bool tried = false;
+        if (!tried && !unavailable) {
+            tried = true;
+            ring.reset(new IoRing());
+            if (!ring->ready) {
+                ring.reset();
+                unavailable = true;
+            }
+        }
+        return ring.get();
+    }
+
+    // Submits every op and waits for all completions; ops are independent
+    // and may complete in any order
+    void run(IoOp* ops, size_t count) {
+        size_t next = 0, done = 0, in_flight = 0;
+        while (done < count) {
+            unsigned tail = *sq_tail;
+            unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            while (next < count && tail - head < sq_entries && in_flight < cq_entries) {
+                unsigned slot = tail & *sq_mask;
+                prepare(sqes[slot], ops[next], next);
+                sq_array[slot] = slot;
+                tail++;
+                next++;
+                in_flight++;
+            }
+            __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+            unsigned to_submit = tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            Trace::count(Trace::IO_URING_ENTERS);
+            long ret = syscall(__NR_io_uring_enter, fd, to_submit, in_flight, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                throw runtime_error("io_uring_enter failed: " + string(strerror(errno)));
+            }
+
+            unsigned cq_h = *cq_head;
+            unsigned cq_t = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for (; cq_h != cq_t; cq_h++) {
+                const io_uring_cqe& cqe = cqes[cq_h & *cq_mask];
+                ops[cqe.user_data].result = cqe.res;
+                done++;
+                in_flight--;
+            }
+            __atomic_store_n(cq_head, cq_h, __ATOMIC_RELEASE);
+        }
+    }
+
+private:
+    static constexpr unsigned ENTRIES = 256;
+
+    int fd = -1;
+    bool ready = false;
+    unsigned sq_entries = 0, cq_entries = 0;
+    void* sq_ptr = MAP_FAILED;
+    void* cq_ptr = MAP_FAILED;
+    size_t sq_len = 0, cq_len = 0, sqes_len = 0;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    io_uring_cqe* cqes = nullptr;
+
+    IoRing() {
+        io_uring_params params{};
+        fd = syscall(__NR_io_uring_setup, ENTRIES, &params);
+        if (fd < 0) return;
+        sq_entries = params.sq_entries;
+        cq_entries = params.cq_entries;
+
+        sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) sq_len = cq_len = max(sq_len, cq_len);
+
+        sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) return;
+        cq_ptr = single_mmap ? sq_ptr
+                             : mmap(nullptr, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                    IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) return;
+        sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(
+            mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED) return;
+
+        char* sq = static_cast<char*>(sq_ptr);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        char* cq = static_cast<char*>(cq_ptr);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        ready = supportsOps();
+    }
+
+    // Kernels before 5.11 lack RENAMEAT, before 5.6 OPENAT/STATX/READ/WRITE
+    bool supportsOps() {
+        const size_t count = 256;
+        vector<char> buffer(sizeof(io_uring_probe) + count * sizeof(io_uring_probe_op));
+        auto* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, count) < 0) return false;
+        for (int op : {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_FSYNC,
+                       IORING_OP_RENAMEAT, IORING_OP_STATX}) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+        }
+        return true;
+    }
+
+    static void prepare(io_uring_sqe& sqe, const IoOp& op, size_t index) {
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.user_data = index;
+        switch (op.kind) {
+            case IoOp::OPEN:
+                sqe.opcode = IORING_OP_OPENAT;
+                sqe.fd = AT_FDCWD;
+                sqe.addr = reinterpret_cast<uint64_t>(op.path);
+                sqe.len = op.mode;
+                sqe.open_flags = op.flags;
+                break;
+            case IoOp::READ:
+            case IoOp::WRITE:
+                sqe.opcode = op.kind == IoOp::READ ? IORING_OP_READ : IORING_OP_WRITE;
+                sqe.fd = op.fd;
+                sqe.addr = reinterpret_cast<uint64_t>(op.buf);
+                sqe.len = op.len;
+                sqe.off = op.offset;
+                break;
+            case IoOp::CLOSE:
+                sqe.opcode = IORING_OP_CLOSE;
+                sqe.fd = op.fd;
+                break;
+            case IoOp::FSYNC:
+                sqe.opcode = IORING_OP_FSYNC;
+                sqe.fd = op.fd;
+                break;
+            case IoOp::RENAME:
+                sqe.opcode = IORING_OP_RENAMEAT;
+                sqe.fd = AT_FDCWD;
+                sqe.addr = reinterpret_cast<uint64_t>(op.path);
+                sqe.len = AT_FDCWD;
+                sqe.addr2 = reinterpret_cast<uint64_t>(op.path2);
+                break;
+            case IoOp::STATX:
+                sqe.opcode = IORING_OP_STATX;
+                sqe.fd = AT_FDCWD;
+                sqe.addr = reinterpret_cast<uint64_t>(op.path);
+                sqe.len = STATX_BASIC_STATS;
+                sqe.off = reinterpret_cast<uint64_t>(op.buf);
+                break;
+        }
+    }
+};
+
+// A batch of independent file operations, run together by run(): through
+// the calling thread's io_uring (a handful of syscalls for the whole batch)
+// or, where io_uring is unavailable or disabled, as plain syscalls spread
+// over a thread pool. Dependent steps (open, then read) are separate batches.
+class IoBatch {
+public:
+    explicit IoBatch(bool use_ring) : use_ring(use_ring) {}
+
+    size_t open(const string& path, int flags, mode_t mode = 0) {
+        return add({IoOp::OPEN, -1, flags | O_CLOEXEC, mode, path.c_str()});
+    }
+    size_t read(int fd, void* buf, size_t len) { return add({IoOp::READ, fd, 0, 0, nullptr, nullptr, buf, len}); }
+    size_t write(int fd, const void* buf, size_t len) {
+        return add({IoOp::WRITE, fd, 0, 0, nullptr, nullptr, const_cast<void*>(buf), len});
+    }
+    size_t close(int fd) { return add({IoOp::CLOSE, fd}); }
+    size_t fsync(int fd) { return add({IoOp::FSYNC, fd}); }
+    size_t rename(const string& from, const string& to) {
+        return add({IoOp::RENAME, -1, 0, 0, from.c_str(), to.c_str()});
+    }
+    size_t statx(const string& path, struct statx* out) {
+        return add({IoOp::STATX, -1, 0, 0, path.c_str(), nullptr, out});
+    }
+
+    size_t size() const { return ops.size(); }
+    long result(size_t i) const { return ops[i].result; }
+
+    void run() {
+        if (ops.empty()) return;
+        Trace::count(Trace::IO_OPS, ops.size());
+        IoRing* ring = use_ring ? IoRing::forThread() : nullptr;
+        if (ring) {
+            ring->run(ops.data(), ops.size());
+        } else if (ops.size() < POOL_THRESHOLD || ThreadPool::inWorker()) {
+            // Already on a pool worker: the pool is the parallelism
+            for (auto& op : ops) perform(op);
+        } else {
+            // One pool serves every fallback batch, so a refresh or checkout
+            // does not start threads per round; batches take turns on it
+            static mutex pool_mutex;
+            lock_guard<mutex> lock(pool_mutex);
+            ThreadPool& pool = fallbackPool();
+            size_t pieces = min(pool.size(), ops.size() / POOL_THRESHOLD + 1);
+            size_t step = (ops.size() + pieces - 1) / pieces;
+            for (size_t start = 0; start < ops.size(); start += step) {
+                pool.submit([this, start, step] {
+                    for (size_t i = start; i < min(start + step, ops.size()); i++) perform(ops[i]);
+                });
+            }
+            pool.wait();
+        }
+    }
+
+private:
+    static constexpr size_t POOL_THRESHOLD = 64;
+
+    // Started on first use and never torn down: joining at exit would
+    // also run in a forked fsmonitor daemon, which has no such threads
+    static ThreadPool& fallbackPool() {
+        static ThreadPool* pool = new ThreadPool(thread::hardware_concurrency());
+        return *pool;
+    }
+
+    bool use_ring;
+    vector<IoOp> ops;
+
+    size_t add(IoOp op) {
+        ops.push_back(op);
+        return ops.size() - 1;
+    }
+
+    static void perform(IoOp& op) {
+        long r = 0;
+        switch (op.kind) {
+            case IoOp::OPEN: r = ::open(op.path, op.flags, op.mode); break;
+            case IoOp::READ: r = pread(op.fd, op.buf, op.len, op.offset); break;
+            case IoOp::WRITE: r = pwrite(op.fd, op.buf, op.len, op.offset); break;
+            case IoOp::CLOSE: r = ::close(op.fd); break;
+            case IoOp::FSYNC: r = ::fsync(op.fd); break;
+            case IoOp::RENAME: r = ::rename(op.path, op.path2); break;
+            case IoOp::STATX:
+                r = ::statx(AT_FDCWD, op.path, 0, STATX_BASIC_STATS, static_cast<struct statx*>(op.buf));
+                break;
+        }
+        op.result = r < 0 ? -errno : r;
+    }
+};
+
+// Raw object name, usable as a hash map key
+using ObjectId = array<unsigned char, SHA_DIGEST_LENGTH>;
+
+struct ObjectIdHash {
+    size_t operator()(const ObjectId& id) const {
+        size_t h;
+        memcpy(&h, id.data(), sizeof(h));  // SHA bytes are already uniform
+        return h;
+    }
+};
+
+// Byte-budgeted LRU cache of decompressed objects, keyed by raw SHA-1 by
+// default; the pack reader also keys one by pack position for delta bases.
+// Safe to use from several threads.
+template <typename K = ObjectId, typename KeyHash = ObjectIdHash>
+class ObjectCache {
+public:
+    using Key = K;
+    using Stats = ObjectCacheStats;
+
+    explicit ObjectCache(size_t budget, Trace::Counter hit_counter = Trace::OBJECT_CACHE_HITS,
+                         Trace::Counter miss_counter = Trace::OBJECT_CACHE_MISSES)
+        : budget(budget), hit_counter(hit_counter), miss_counter(miss_counter) {}
+
+    shared_ptr<const ObjectData> get(const Key& key) {
+        lock_guard<mutex> lock(m);
+        auto it = lookup.find(key);
+        if (it == lookup.end()) {
+            misses++;
+            Trace::count(miss_counter);
+            return nullptr;
+        }
+        hits++;
+        Trace::count(hit_counter);
+        lru.splice(lru.begin(), lru, it->second);  // Most recently used first
+        return it->second->object;
+    }
+
+    void put(const Key& key, shared_ptr<const ObjectData> object) {
+        size_t cost = object->size + ENTRY_OVERHEAD;
+        lock_guard<mutex> lock(m);
+        if (cost > budget || lookup.count(key)) return;
+
+        lru.push_front({key, move(object), cost});
+        lookup[key] = lru.begin();
+        bytes += cost;
+        shrinkTo(budget);
+    }
+
+    void setBudget(size_t new_budget) {
+        lock_guard<mutex> lock(m);
+        budget = new_budget;
+        shrinkTo(budget);
+    }
+
+    void clear() {
+        lock_guard<mutex> lock(m);
+        shrinkTo(0);
+    }
+
+    Stats stats() const {
+        lock_guard<mutex> lock(m);
+        return {hits, misses, evictions, lookup.size(), bytes, budget};
+    }
+
+private:
+    // Rough per-entry bookkeeping cost (list node, map node, control block)
+    static constexpr size_t ENTRY_OVERHEAD = 128;
+
+    struct Entry {
+        Key key;
+        shared_ptr<const ObjectData> object;
+        size_t cost;
+    };
+
+    mutable mutex m;
+    list<Entry> lru;
+    unordered_map<Key, typename list<Entry>::iterator, KeyHash> lookup;
+    size_t budget;
+    Trace::Counter hit_counter;
+    Trace::Counter miss_counter;
+    size_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+
+    void shrinkTo(size_t limit) {
+        while (bytes > limit && !lru.empty()) {
+            bytes -= lru.back().cost;
+            lookup.erase(lru.back().key);
+            lru.pop_back();
+            evictions++;
+        }
+    }
+};
+
+// Working tree change tracker behind `mygit fsmonitor`. Every inotify event
+// stamps its path with the next sequence number, so "what changed since
+// token X" is the set of paths stamped after X. Tokens are
+// "<instance>:<sequence>"; an empty token, one from another daemon instance
+// or one older than a queue overflow is answered with "*" (scan everything).
+//
+// Protocol on the Unix socket, one request per connection:
+//   "changes <token>\n" -> "<new token>\n" then "*\n" or NUL-terminated paths
+//   "status\n"          -> one line of counts
+//   "quit\n"            -> "ok\n", then the daemon exits
+// A reported directory was created, moved or deleted as a whole; the client
+// rescans it.
+class FsMonitor {
+public:
+    FsMonitor(const string& socket_path, const string& git_dir)
+        : socket_path(socket_path), git_dir(git_dir) {
+        instance = to_string(getpid()) + "." + to_string(time(nullptr));
+    }
+
+    ~FsMonitor() {
+        if (listen_fd >= 0) {
+            close(listen_fd);
+            unlink(socket_path.c_str());
+        }
+        if (inotify_fd >= 0) close(inotify_fd);
+    }
+
+    FsMonitor(const FsMonitor&) = delete;
+    FsMonitor& operator=(const FsMonitor&) = delete;
+
+    // Drops this process's handles after a fork, leaving the socket to the
+    // child
+    void disown() {
+        close(listen_fd);
+        close(inotify_fd);
+        listen_fd = inotify_fd = -1;
+    }
+
+    // Sets up every watch before the socket accepts its first client, so
+    // no token is handed out for a state that is not fully watched
+    void listen() {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0) {
+            throw runtime_error("inotify_init1 failed: " + string(strerror(errno)));
+        }
+        watchTree("");
+        if (degraded) {
+            cerr << "fsmonitor: out of inotify watches (see fs.inotify.max_user_watches); "
+                    "every query will get a full scan\n";
+        }
+
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un addr = socketAddress(socket_path);
+        if (listen_fd < 0) throw runtime_error("Cannot create socket");
+        if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            // A socket nobody answers on is left over from a dead daemon
+            if (errno != EADDRINUSE || connectTo(socket_path) >= 0) {
+                throw runtime_error("fsmonitor is already running (" + socket_path + ")");
+            }
+            unlink(socket_path.c_str());
+            if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+                throw runtime_error("Cannot bind " + socket_path + ": " + strerror(errno));
+            }
+        }
+        if (::listen(listen_fd, 16) != 0) {
+            throw runtime_error("Cannot listen on " + socket_path);
+        }
+    }
+
+    // Serves until a "quit" request
+    void run() {
+        pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {listen_fd, POLLIN, 0}};
+        while (!quit) {
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error("poll failed");
+            }
+            if (fds[0].revents & POLLIN) readEvents();
+            if (fds[1].revents & POLLIN) {
+                int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+                if (client >= 0) {
+                    serve(client);
+                    close(client);
+                }
+            }
+        }
+    }
+
+    static sockaddr_un socketAddress(const string& path) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            throw runtime_error("Socket path too long: " + path);
+        }
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        return addr;
+    }
+
+    // Connected socket or -1; replies must arrive within a second
+    static int connectTo(const string& path) {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        sockaddr_un addr = socketAddress(path);
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+        timeval timeout{1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        return fd;
+    }
+
+    // Sends one request and returns the whole reply ("" on any failure)
+    static string request(const string& path, const string& message) {
+        int fd = connectTo(path);
+        if (fd < 0) return "";
+        string reply;
+        if (write(fd, message.data(), message.size()) == ssize_t(message.size())) {
+            shutdown(fd, SHUT_WR);
+            char buffer[65536];
+            ssize_t n;
+            while ((n = read(fd, buffer, sizeof(buffer))) > 0) reply.append(buffer, n);
+            if (n < 0) reply.clear();
+        }
+        close(fd);
+        return reply;
+    }
+
+private:
+    static constexpr uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE |
+                                           IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR |
+                                           IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+    // Stamped paths kept before the daemon forgets them all, as on an
+    // inotify queue overflow; bounds a long-running daemon's memory
+    static constexpr size_t MAX_CHANGED_PATHS = 100000;
+
+    string socket_path;
+    string git_dir;
+    string instance;
+    int inotify_fd = -1;
+    int listen_fd = -1;
+    unordered_map<int, string> watches;       // watch descriptor -> directory ("" = root)
+    unordered_map<string, uint64_t> changed;  // path -> sequence of its last event
+    uint64_t sequence = 0;
+    uint64_t overflow_sequence = 0;  // tokens before this get a full scan
+    bool degraded = false;           // some directory could not be watched
+    bool quit = false;
+
+    // Every token handed out so far now gets a full scan, so the stamps
+    // behind them can go
+    void forgetChanges() {
+        overflow_sequence = ++sequence;
+        changed.clear();
+    }
+
+    void watchTree(const string& dir) {
+        int wd = inotify_add_watch(inotify_fd, dir.empty() ? "." : dir.c_str(), WATCH_MASK);
+        if (wd < 0) {
+            if (errno == ENOSPC || errno == ENOMEM) degraded = true;
+            return;  // gone already; its parent reports that
+        }
+        watches[wd] = dir;
+
+        error_code ec;
+        for (fs::directory_iterator it(dir.empty() ? "." : dir, ec), end; !ec && it != end; it.increment(ec)) {
+            string name = it->path().filename().string();
+            if (dir.empty() && name == git_dir) continue;
+            if (it->is_directory(ec) && !it->is_symlink(ec)) {
+                watchTree(dir.empty() ? name : dir + "/" + name);
+            }
+        }
+    }
+
+    void readEvents() {
+        alignas(inotify_event) char buffer[65536];
+        ssize_t n;
+        while ((n = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+            for (char* p = buffer; p < buffer + n;) {
+                const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+                p += sizeof(inotify_event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW) {
+                    forgetChanges();
+                    continue;
+                }
+                if (event->mask & IN_IGNORED) {
+                    watches.erase(event->wd);
+                    continue;
+                }
+                auto watch = watches.find(event->wd);
+                if (watch == watches.end() || event->len == 0) continue;
+
+                string name = event->name;
+                if (watch->second.empty() && name == git_dir) continue;
+                string path = watch->second.empty() ? name : watch->second + "/" + name;
+                changed[path] = ++sequence;
+                if (changed.size() > MAX_CHANGED_PATHS) forgetChanges();
+
+                if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    watchTree(path);
+                }
+            }
+        }
+    }
+
+    void serve(int client) {
+        timeval timeout{1, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        string line;
+        char c;
+        while (line.size() < 4096 && read(client, &c, 1) == 1 && c != '\n') line.push_back(c);
+
+        // Anything the client did before asking is already queued
+        readEvents();
+
+        string reply;
+        if (line.rfind("changes ", 0) == 0 || line == "changes") {
+            reply = instance + ":" + to_string(sequence) + "\n";
+            string token = line.size() > 8 ? line.substr(8) : "";
+            size_t colon = token.rfind(':');
+            uint64_t since = 0;
+            bool valid = !degraded && colon != string::npos && token.substr(0, colon) == instance;
+            if (valid) {
+                auto [end, ec] = from_chars(token.data() + colon + 1, token.data() + token.size(), since);
+                valid = ec == errc() && end == token.data() + token.size() && since >= overflow_sequence;
+            }
+            if (!valid) {
+                reply += "*\n";
+            } else {
+                for (const auto& [path, stamp] : changed) {
+                    if (stamp <= since) continue;
+                    reply += path;
+                    reply.push_back('\0');
+                }
+            }
+        } else if (line == "status") {
+            reply = "watching " + to_string(watches.size()) + " directories, " + to_string(changed.size()) +
+                    " changed paths, token " + instance + ":" + to_string(sequence) +
+                    (degraded ? " (degraded: out of watches)" : "") + "\n";
+        } else if (line == "quit") {
+            reply = "ok\n";
+            quit = true;
+        } else {
+            reply = "error unknown request\n";
+        }
+
+        for (size_t sent = 0; sent < reply.size();) {
+            ssize_t n = write(client, reply.data() + sent, reply.size() - sent);
+            if (n <= 0) break;
+            sent += n;
+        }
+    }
+};
+
+class MiniVCS {
+    friend class Repository;
+    friend struct TreeEntry;
+
+private:
+    const string GIT_DIR = ".mygit";
+    const string OBJECTS_DIR = GIT_DIR + "/objects";
+    const string REFS_DIR = GIT_DIR + "/refs";
+    const string HEAD_FILE = GIT_DIR + "/HEAD";
+    const string INDEX_FILE = GIT_DIR + "/index";
+    const string CONFIG_FILE = GIT_DIR + "/config";
+    const string COMMIT_GRAPH_FILE = OBJECTS_DIR + "/info/commit-graph";
+    const string BLOOM_FILE = OBJECTS_DIR + "/info/commit-graph-bloom";
+    const string FSMONITOR_SOCKET = GIT_DIR + "/fsmonitor.sock";
+
+    static constexpr size_t DEFAULT_OBJECT_CACHE_SIZE = 32 << 20;
+    static constexpr size_t DEFAULT_DELTA_BASE_CACHE = 32 << 20;
+    static constexpr size_t DEFAULT_CHECKOUT_INFLIGHT = 64 << 20;
+    // Blobs up to this size are read whole, so their SHA is known (and an
+    // existing object skipped) before anything is compressed
+    static constexpr size_t SMALL_BLOB = 1 << 20;
+    static constexpr size_t DEFAULT_CHUNK_MIN = 256 << 10;
+    static constexpr size_t DEFAULT_CHUNK_AVG = 1 << 20;
+    static constexpr size_t DEFAULT_CHUNK_MAX = 4 << 20;
+
+    // How loose objects reach the disk (core.fsyncObjects):
+    //   none   - rename into place, leave flushing to the kernel
+    //   object - fsync every object before renaming it
+    //   batch  - hold renames until the next index or ref update, then
+    //            flush the filesystem once and rename them all
+    enum class FsyncMode { NONE, OBJECT, BATCH };
+
+    // The index is a stat cache of the working tree: one entry per file,
+    // sorted by path, so unchanged files are never re-hashed.
+    //
+    // On-disk layout (all integers big-endian):
+    //   "MGIX" | version u32 | entry count u32
+    //   entries: mtime_ns u64 | ctime_ns u64 | size u64 | ino u64 | dev u64 |
+    //            mode u32 | sha1[20] | path length u16 | path | NUL pad to 8
+    //   extensions: signature[4] | length u32 | data
+    //   SHA-1 of everything above
+    struct IndexEntry {
+        string path;
+        uint64_t mtime_ns;
+        uint64_t ctime_ns;
+        uint64_t size;
+        uint64_t ino;
+        uint64_t dev;
+        uint32_t mode;
+        unsigned char sha1[SHA_DIGEST_LENGTH];
+    };
+
+    static constexpr char INDEX_SIGNATURE[4] = {'M', 'G', 'I', 'X'};
+    static constexpr uint32_t INDEX_VERSION = 1;
+    static constexpr size_t INDEX_ENTRY_FIXED = 5 * 8 + 4 + SHA_DIGEST_LENGTH + 2;
+
+    // Cache-tree index extension: the tree SHA last written for each
+    // directory, keyed by path ("" is the root). An entry is dropped as soon
+    // as anything below its directory is staged or removed, so a snapshot only
+    // rebuilds trees along changed paths.
+    //   "TREE" | length u32 | entries: path NUL | file count u32 |
+    //                                  subtree count u32 | sha1[20]
+    static constexpr char CACHE_TREE_SIGNATURE[4] = {'T', 'R', 'E', 'E'};
+
+    // fsmonitor index extension: the daemon token the index was last fully
+    // refreshed against, and every directory of the working tree at that
+    // point. Paths the daemon has not reported since are trusted as is.
+    //   "FSMN" | length u32 | token NUL | directory NUL ...
+    static constexpr char FSMONITOR_SIGNATURE[4] = {'F', 'S', 'M', 'N'};
+
+    struct FsChanges {
+        bool full = true;      // no usable answer: scan everything
+        string token;          // "" when no daemon answered
+        vector<string> paths;  // changed since the index token
+    };
+
+    struct CacheTreeEntry {
+        uint32_t entry_count;    // files anywhere below the directory
+        uint32_t subtree_count;  // immediate subdirectories
+        unsigned char sha1[SHA_DIGEST_LENGTH];
+    };
+
+    // A working tree snapshot: directories are enumerated up front, then file
+    // hashing runs on the thread pool and each tree object is written as soon
+    // as the last of its children is done. Children are sorted in git tree order so the
+    // tree SHA does not depend on enumeration or scheduling order.
+    struct SnapshotChild {
+        string name;
+        bool is_dir;
+        size_t index;  // into Snapshot::dirs or Snapshot::files
+    };
+
+    struct SnapshotDir {
+        string path;
+        long parent;  // -1 for the root
+        vector<SnapshotChild> children;
+        string sha;
+        uint32_t entry_count = 0;
+        uint32_t subtree_count = 0;
+        bool unchanged = false;  // sha came from the cache-tree
+    };
+
+    struct SnapshotFile {
+        string path;
+        size_t dir;
+        IndexEntry entry;
+        bool unchanged = false;  // entry came from the stat cache
+    };
+
+    struct Snapshot {
+        vector<SnapshotDir> dirs;
+        vector<SnapshotFile> files;
+    };
+
+    vector<IndexEntry> index;
+    map<string, CacheTreeEntry> cache_tree;
+    bool fsmonitor_enabled = false;
+    bool use_io_uring = true;  // core.ioBackend; IoBatch falls back if the kernel refuses
+    bool verify_objects = false;  // core.verifyObjects: re-hash every object read
+    string fsmonitor_token;
+    vector<string> fsmonitor_dirs;
+    bool index_loaded = false;
+    uint64_t index_mtime_ns = 0;
+    size_t jobs = 0;  // 0 = one worker per hardware thread
+    map<string, string> config;  // "section.key" (lowercase) -> value
+    ObjectCache<> object_cache{DEFAULT_OBJECT_CACHE_SIZE};
+
+    // zlib levels (-1 = zlib's default); chunk lists use the tree level
+    struct CompressionConfig {
+        int blob = Z_BEST_SPEED;
+        int tree = Z_DEFAULT_COMPRESSION;
+        int commit = Z_DEFAULT_COMPRESSION;
+        int pack = Z_BEST_COMPRESSION;
+        bool store_incompressible = true;
+    } compression;
+
+    // Content-defined chunking of large files; off while the threshold is 0
+    size_t chunk_threshold = 0;
+    size_t chunk_min = DEFAULT_CHUNK_MIN;
+    size_t chunk_avg = DEFAULT_CHUNK_AVG;
+    size_t chunk_max = DEFAULT_CHUNK_MAX;
+
+    // Objects known to exist (or pending in the current batch), so repeated
+    // writes of the same content skip the filesystem entirely
+    FsyncMode fsync_mode = FsyncMode::BATCH;
+    unordered_set<ObjectId, ObjectIdHash> known_objects;
+    vector<pair<string, string>> pending_objects;  // temp path -> final path
+    mutex objects_mutex;
+
+    // Helper functions
+    static void putBE16(string& out, uint16_t v) {
+        out.push_back(char(v >> 8));
+        out.push_back(char(v));
+    }
+
+    static void putBE32(string& out, uint32_t v) {
+        for (int shift = 24; shift >= 0; shift -= 8) out.push_back(char(v >> shift));
+    }
+
+    static void putBE64(string& out, uint64_t v) {
+        for (int shift = 56; shift >= 0; shift -= 8) out.push_back(char(v >> shift));
+    }
+
+    static uint16_t getBE16(const unsigned char* p) {
+        return uint16_t(p[0] << 8 | p[1]);
+    }
+
+    static uint32_t getBE32(const unsigned char* p) {
+        return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+    }
+
+    static uint64_t getBE64(const unsigned char* p) {
+        return uint64_t(getBE32(p)) << 32 | getBE32(p + 4);
+    }
+
+    static uint64_t toNs(const timespec& ts) {
+        return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+    }
+
+    static string toHex(const unsigned char* raw) {
+        static const char digits[] = "0123456789abcdef";
+        string hex(SHA_DIGEST_LENGTH * 2, '0');
+        for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
+            hex[2 * i] = digits[raw[i] >> 4];
+            hex[2 * i + 1] = digits[raw[i] & 0xf];
+        }
+        return hex;
+    }
+
+    static bool fromHex(string_view hex, unsigned char* raw) {
+        if (hex.size() != SHA_DIGEST_LENGTH * 2) return false;
+        for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
+            int hi = hexValue(hex[2 * i]), lo = hexValue(hex[2 * i + 1]);
+            if (hi < 0 || lo < 0) return false;
+            raw[i] = (unsigned char)(hi << 4 | lo);
+        }
+        return true;
+    }
+
+    static int hexValue(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    // Repository-relative form of a user-supplied path ("" for the root)
+    static string normalizePath(const string& path) {
+        string normal = fs::path(path).lexically_normal().generic_string();
+        while (!normal.empty() && normal.back() == '/') normal.pop_back();
+        if (normal == ".") return "";
+        if (normal.rfind("./", 0) == 0) normal = normal.substr(2);
+        return normal;
+    }
+
+    static string trim(const string& text) {
+        size_t start = text.find_first_not_of(" \t\r");
+        if (start == string::npos) return "";
+        size_t end = text.find_last_not_of(" \t\r");
+        return text.substr(start, end - start + 1);
+    }
+
+    static string lowercase(string text) {
+        transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return tolower(c); });
+        return text;
+    }
+
+    // Reads the git-style config file:
+    //   [section]
+    //       key = value   ; comments start with '#' or ';'
+    // Keys are stored as "section.key", case-insensitively.
+    void loadConfig() {
+        config.clear();
+        ifstream file(CONFIG_FILE);
+        string line, section;
+        while (getline(file, line)) {
+            size_t comment = line.find_first_of("#;");
+            if (comment != string::npos) line = line.substr(0, comment);
+            line = trim(line);
+            if (line.empty()) continue;
+
+            if (line.front() == '[') {
+                if (line.back() != ']') {
+                    throw runtime_error("Bad config section: " + line);
+                }
+                section = lowercase(trim(line.substr(1, line.size() - 2)));
+                continue;
+            }
+
+            size_t eq = line.find('=');
+            string key = lowercase(trim(line.substr(0, eq)));
+            string value = eq == string::npos ? "true" : trim(line.substr(eq + 1));
+            if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+                value = value.substr(1, value.size() - 2);
+            }
+            config[section + "." + key] = value;
+        }
+    }
+
+    // Sizes accept k/m/g suffixes (powers of 1024)
+    size_t configSize(const string& key, size_t fallback) const {
+        auto it = config.find(key);
+        if (it == config.end()) return fallback;
+
+        const string& value = it->second;
+        size_t pos = 0;
+        unsigned long long number;
+        try {
+            number = stoull(value, &pos);
+        } catch (const exception&) {
+            throw runtime_error("Bad size for " + key + ": " + value);
+        }
+        string suffix = lowercase(value.substr(pos));
+        if (suffix == "k") number <<= 10;
+        else if (suffix == "m") number <<= 20;
+        else if (suffix == "g") number <<= 30;
+        else if (!suffix.empty()) throw runtime_error("Bad size for " + key + ": " + value);
+        return number;
+    }
+
+    int configLevel(const string& key, int fallback) const {
+        auto it = config.find(key);
+        if (it == config.end()) return fallback;
+        int level;
+        auto [end, ec] = from_chars(it->second.data(), it->second.data() + it->second.size(), level);
+        if (ec != errc() || end != it->second.data() + it->second.size() || level < -1 || level > 9) {
+            throw runtime_error("Bad compression level for " + key + ": " + it->second);
+        }
+        return level;
+    }
+
+    // Already-compressed data (media, archives) has a near-uniform byte
+    // histogram. A 4 KB sample with more than 7.5 bits of entropy per byte
+    // is not worth deflating, so it is stored instead.
+    bool looksIncompressible(const void* data, size_t len) const {
+        if (!compression.store_incompressible || len < 1024) return false;
+        size_t sample = min<size_t>(len, 4096);
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        uint32_t counts[256] = {};
+        for (size_t i = 0; i < sample; i++) counts[bytes[i]]++;
+
+        double entropy = 0;
+        for (uint32_t count : counts) {
+            if (count == 0) continue;
+            double p = double(count) / sample;
+            entropy -= p * log2(p);
+        }
+        return entropy > 7.5;
+    }
+
+    // Loose object level; `sample` is the start of the content (may be empty)
+    int compressionLevel(string_view type, const void* sample, size_t len) const {
+        if (type == "blob") {
+            return looksIncompressible(sample, len) ? Z_NO_COMPRESSION : compression.blob;
+        }
+        return type == "commit" ? compression.commit : compression.tree;
+    }
+
+    static string objectHeader(const string& type, uint64_t size) {
+        string header = type + " " + to_string(size);
+        header.push_back('\0');
+        return header;
+    }
+
+    // Streams one object of a known size: the SHA-1 and, when writing, the
+    // deflate stream are fed chunk by chunk, and compressed output goes
+    // straight to a temp file that is renamed into objects/xx/ on finish.
+    // Memory use is a few buffers regardless of the object size.
+    class ObjectWriter {
+    public:
+        ObjectWriter(MiniVCS& vcs, const string& type, uint64_t size, bool write)
+            : vcs(vcs), type(type), expected(size), writing(write), header(objectHeader(type, size)) {
+            hasher.update(header.data(), header.size());
+            if (writing) {
+                tmp_path = vcs.OBJECTS_DIR + "/tmp_obj_XXXXXX";
+                fd = mkstemp(tmp_path.data());
+                if (fd < 0) {
+                    throw runtime_error("Cannot create temporary object file");
+                }
+                out.resize(CHUNK);
+            }
+        }
+
+        ~ObjectWriter() {
+            if (fd >= 0) {
+                close(fd);
+                unlink(tmp_path.c_str());
+            }
+        }
+
+        ObjectWriter(const ObjectWriter&) = delete;
+        ObjectWriter& operator=(const ObjectWriter&) = delete;
+
+        void update(const void* data, size_t len) {
+            seen += len;
+            if (seen > expected) {
+                throw runtime_error("Object content is larger than its declared size");
+            }
+            {
+                Trace::Span step("sha1", false);
+                hasher.update(data, len);
+            }
+            if (writing) {
+                if (!deflater) startDeflate(data, len);
+                deflateInput(data, len, Z_NO_FLUSH);
+            }
+        }
+
+        // Returns the hex SHA-1; the object is in place when this returns
+        string finish() {
+            if (seen != expected) {
+                throw runtime_error("Object content is smaller than its declared size");
+            }
+
+            unsigned char raw[SHA_DIGEST_LENGTH];
+            hasher.finish(raw);
+            string sha = toHex(raw);
+            Trace::count(Trace::OBJECTS_HASHED);
+            Trace::count(Trace::BYTES_HASHED, seen);
+
+            if (writing) {
+                if (!deflater) startDeflate(nullptr, 0);
+                deflateInput(nullptr, 0, Z_FINISH);
+                deflater.reset();
+                Trace::count(Trace::OBJECTS_WRITTEN);
+                Trace::count(Trace::BYTES_DEFLATED, seen);
+
+                fchmod(fd, 0444);
+                if (vcs.fsync_mode == FsyncMode::OBJECT) {
+                    Trace::Span step("fsync", false);
+                    Trace::count(Trace::SYS_FSYNC);
+                    if (fsync(fd) != 0) throw runtime_error("Failed to sync object " + sha);
+                }
+                close(fd);
+                fd = -1;
+                vcs.publishObject(tmp_path, raw);
+            }
+            return sha;
+        }
+
+    private:
+        static constexpr size_t CHUNK = 65536;
+
+        MiniVCS& vcs;
+        string type;
+        uint64_t expected;
+        uint64_t seen = 0;
+        bool writing;
+        string header;
+        Hasher hasher;
+        optional<Deflater> deflater;
+        int fd = -1;
+        string tmp_path;
+        vector<unsigned char> out;
+
+        // The level is picked once the first content is in hand, so the
+        // header waits until then
+        void startDeflate(const void* sample, size_t len) {
+            deflater.emplace(vcs.compressionLevel(type, sample, len));
+            deflateInput(header.data(), header.size(), Z_NO_FLUSH);
+        }
+
+        void deflateInput(const void* data, size_t len, int flush) {
+            Trace::Span step("deflate", false);
+            z_stream& strm = deflater->stream();
+            strm.next_in = (Bytef*)data;
+            strm.avail_in = len;
+            do {
+                strm.next_out = out.data();
+                strm.avail_out = out.size();
+                deflate(&strm, flush);
+                writeAll(out.data(), out.size() - strm.avail_out);
+            } while (strm.avail_out == 0);
+        }
+
+        void writeAll(const unsigned char* data, size_t len) {
+            while (len > 0) {
+                ssize_t n = write(fd, data, len);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    throw runtime_error("Failed to write object data");
+                }
+                Trace::count(Trace::BYTES_WRITTEN, n);
+                data += n;
+                len -= n;
+            }
+        }
+    };
+
+    // Hashing is cheap next to deflate, so the SHA is computed first and
+    // nothing is compressed for an object that already exists
+    string writeObject(const string& type, string_view content) {
+        ObjectWriter hasher(*this, type, content.size(), false);
+        hasher.update(content.data(), content.size());
+        string sha = hasher.finish();
+        if (hasObject(sha)) return sha;
+
+        ObjectWriter writer(*this, type, content.size(), true);
+        writer.update(content.data(), content.size());
+        return writer.finish();
+    }
+
+    bool hasObject(const string& sha) {
+        ObjectId id;
+        if (!fromHex(sha, id.data())) return false;
+        {
+            lock_guard<mutex> lock(objects_mutex);
+            if (known_objects.count(id)) {
+                Trace::count(Trace::KNOWN_OBJECT_HITS);
+                return true;
+            }
+        }
+
+        bool found = access((OBJECTS_DIR + "/" + sha.substr(0, 2) + "/" + sha.substr(2)).c_str(), F_OK) == 0;
+        if (!found) {
+            loadPacks();
+            uint64_t offset;
+            for (const auto& pack : packs) {
+                if (findPackEntry(*pack, id.data(), offset)) {
+                    found = true;
+                    break;
+                }
+            }
+        }
+        if (found) {
+            lock_guard<mutex> lock(objects_mutex);
+            known_objects.insert(id);
+        }
+        return found;
+    }
+
+    // Moves a finished temp file to its object path, or queues it for the
+    // next flush in batch mode. A concurrent writer of the same object wins
+    // and the duplicate is dropped.
+    void publishObject(const string& tmp_path, const unsigned char* raw) {
+        ObjectId id;
+        memcpy(id.data(), raw, SHA_DIGEST_LENGTH);
+        string sha = toHex(raw);
+        string dir = OBJECTS_DIR + "/" + sha.substr(0, 2);
+        string path = dir + "/" + sha.substr(2);
+
+        lock_guard<mutex> lock(objects_mutex);
+        if (!known_objects.insert(id).second) {
+            unlink(tmp_path.c_str());
+            return;
+        }
+        if (fsync_mode == FsyncMode::BATCH) {
+            pending_objects.emplace_back(tmp_path, path);
+            return;
+        }
+
+        error_code ec;
+        fs::create_directories(dir, ec);
+        Trace::count(Trace::SYS_RENAME);
+        if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+            unlink(tmp_path.c_str());
+            known_objects.erase(id);
+            throw runtime_error("Failed to write object " + sha);
+        }
+    }
+
+    // Makes every queued object durable with a single filesystem flush and
+    // renames them into place. Called before anything that can reference
+    // them (index, refs) is written.
+    void flushObjects() {
+        lock_guard<mutex> lock(objects_mutex);
+        if (pending_objects.empty()) return;
+        Trace::Span span("flushObjects");
+
+        {
+            Trace::Span step("fsync", false);
+            Trace::count(Trace::SYS_FSYNC);
+            int dir_fd = open(OBJECTS_DIR.c_str(), O_RDONLY | O_DIRECTORY);
+            if (dir_fd < 0 || syncfs(dir_fd) != 0) {
+                sync();
+            }
+            if (dir_fd >= 0) close(dir_fd);
+        }
+        Trace::count(Trace::SYS_RENAME, pending_objects.size());
+
+        // Fan-out directories once each, then all renames as one batch
+        set<string> dirs;
+        for (const auto& entry : pending_objects) {
+            dirs.insert(fs::path(entry.second).parent_path().string());
+        }
+        for (const auto& dir : dirs) {
+            error_code ec;
+            fs::create_directories(dir, ec);
+        }
+        IoBatch renames(use_io_uring);
+        for (const auto& [tmp_path, path] : pending_objects) {
+            renames.rename(tmp_path, path);
+        }
+        renames.run();
+
+        // A failed object is dropped entirely: its temp file goes and it is
+        // no longer known, so a later write of the same content retries it
+        string failed;
+        for (size_t i = 0; i < renames.size(); i++) {
+            if (renames.result(i) >= 0) continue;
+            fs::path path(pending_objects[i].second);
+            unlink(pending_objects[i].first.c_str());
+            ObjectId id;
+            if (fromHex(path.parent_path().filename().string() + path.filename().string(), id.data())) {
+                known_objects.erase(id);
+            }
+            if (failed.empty()) failed = path.string();
+        }
+        pending_objects.clear();
+        if (!failed.empty()) throw runtime_error("Failed to write object " + failed);
+    }
+
+    // An object written in batch mode sits in its temp file until the next
+    // flush; reads find it there so they agree with hasObject. If a flush
+    // renamed it in the meantime, it is at its object path again.
+    int openPendingObject(const string& path) {
+        string tmp_path;
+        {
+            lock_guard<mutex> lock(objects_mutex);
+            for (const auto& entry : pending_objects) {
+                if (entry.second == path) {
+                    tmp_path = entry.first;
+                    break;
+                }
+            }
+        }
+        if (tmp_path.empty()) return -1;
+        Trace::count(Trace::SYS_OPEN);
+        int fd = open(tmp_path.c_str(), O_RDONLY);
+        if (fd < 0) fd = open(path.c_str(), O_RDONLY);
+        return fd;
+    }
+
+    static string_view objectTypeName(string_view type) {
+        for (string_view known : {"blob", "tree", "commit", "chunked"}) {
+            if (type == known) return known;
+        }
+        throw runtime_error("Unknown object type: " + string(type));
+    }
+
+    static shared_ptr<ObjectData> allocateObject(string_view type, size_t size) {
+        auto object = make_shared<ObjectData>();
+        object->type = objectTypeName(type);
+        object->bytes.reset(new char[max<size_t>(size, 1)]);
+        object->size = size;
+        return object;
+    }
+
+    // Type and size without inflating the content
+    ObjectInfo objectInfo(const string& sha) {
+        ObjectId key;
+        if (!fromHex(sha, key.data())) {
+            throw runtime_error("Object not found: " + sha);
+        }
+        if (auto cached = object_cache.get(key)) return {cached->type, cached->size};
+
+        ObjectInfo info;
+        if (packedObjectInfo(key.data(), info)) return info;
+        readLooseObject(sha, &info);
+        return info;
+    }
+
+    // `cache` = false keeps one-off reads (file chunks streamed to disk)
+    // from evicting the working set
+    ObjectView readObject(const string& sha, bool cache = true) {
+        ObjectId key;
+        if (!fromHex(sha, key.data())) {
+            throw runtime_error("Object not found: " + sha);
+        }
+        if (auto cached = object_cache.get(key)) return ObjectView(cached);
+        Trace::Span span("readObject");
+
+        // Pack lookups are in-memory, so try them before touching the disk
+        shared_ptr<ObjectData> object = readObjectFromPacks(key.data());
+        if (!object) object = readLooseObject(sha);
+        if (verify_objects) verifyObject(key, *object);
+        Trace::count(Trace::OBJECTS_READ);
+        Trace::count(Trace::BYTES_INFLATED, object->size);
+        if (cache) object_cache.put(key, object);
+        return ObjectView(object);
+    }
+
+    // The content must hash back to the name it was looked up by
+    static void verifyObject(const ObjectId& id, const ObjectData& object) {
+        string header = string(object.type) + " " + to_string(object.size);
+        header.push_back('\0');
+        Hasher hasher;
+        hasher.update(header.data(), header.size());
+        hasher.update(object.bytes.get(), object.size);
+        unsigned char digest[SHA_DIGEST_LENGTH];
+        hasher.finish(digest);
+        Trace::count(Trace::OBJECTS_HASHED);
+        Trace::count(Trace::BYTES_HASHED, object.size);
+        if (memcmp(digest, id.data(), SHA_DIGEST_LENGTH) != 0) {
+            throw runtime_error("Corrupt object " + toHex(id.data()) + ": content hashes to " + toHex(digest));
+        }
+    }
+
+    // Content-defined chunking (FastCDC). Files of at least
+    // chunking.threshold bytes are cut wherever a gear rolling hash matches
+    // a mask, so an edit only changes the chunks it touches. Each chunk is
+    // stored as a blob and the file as a "chunked" manifest:
+    //   size <total>\n
+    //   <chunk sha> <length>\n ...
+    // A stricter mask applies below the average size and a looser one above
+    // it (normalized chunking), which keeps chunk sizes near the average.
+    static const uint64_t* gearTable() {
+        static const array<uint64_t, 256> table = [] {
+            array<uint64_t, 256> gear{};
+            uint64_t state = 0x6d79676974636463ull;  // fixed seed: boundaries must be stable
+            for (auto& value : gear) {
+                // splitmix64
+                uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+                value = z ^ (z >> 31);
+            }
+            return gear;
+        }();
+        return table.data();
+    }
+
+    size_t chunkBoundary(const unsigned char* data, size_t size) const {
+        if (size <= chunk_min) return size;
+        size_t limit = min(size, chunk_max);
+        size_t center = min(limit, chunk_avg);
+
+        int bits = 0;
+        while ((size_t(1) << bits) < chunk_avg) bits++;
+        const uint64_t mask_strict = ~0ull << (64 - (bits + 1));
+        const uint64_t mask_loose = ~0ull << (64 - (bits - 1));
+
+        const uint64_t* gear = gearTable();
+        uint64_t hash = 0;
+        size_t i = chunk_min;
+        for (; i < center; i++) {
+            hash = (hash << 1) + gear[data[i]];
+            if (!(hash & mask_strict)) return i;
+        }
+        for (; i < limit; i++) {
+            hash = (hash << 1) + gear[data[i]];
+            if (!(hash & mask_loose)) return i;
+        }
+        return limit;
+    }
+
+    string chunkFile(int fd, const string& path, bool write) {
+        vector<unsigned char> buffer(2 * chunk_max);
+        size_t start = 0, filled = 0;
+        uint64_t total = 0;
+        bool eof = false;
+        string chunks;
+
+        while (true) {
+            // Keep at least one maximal chunk buffered until EOF
+            if (!eof && filled - start < chunk_max) {
+                memmove(buffer.data(), buffer.data() + start, filled - start);
+                filled -= start;
+                start = 0;
+                while (filled < buffer.size()) {
+                    ssize_t n = read(fd, buffer.data() + filled, buffer.size() - filled);
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n < 0) throw runtime_error("Failed to read " + path);
+                    if (n == 0) {
+                        eof = true;
+                        break;
+                    }
+                    filled += n;
+                }
+            }
+            if (start == filled) break;
+
+            size_t length = chunkBoundary(buffer.data() + start, filled - start);
+            string_view chunk(reinterpret_cast<const char*>(buffer.data() + start), length);
+            string sha;
+            if (write) {
+                sha = writeObject("blob", chunk);
+            } else {
+                ObjectWriter hasher(*this, "blob", length, false);
+                hasher.update(chunk.data(), length);
+                sha = hasher.finish();
+            }
+            chunks += sha + " " + to_string(length) + "\n";
+            total += length;
+            start += length;
+        }
+
+        string manifest = "size " + to_string(total) + "\n" + chunks;
+        if (write) return writeObject("chunked", manifest);
+        ObjectWriter hasher(*this, "chunked", manifest.size(), false);
+        hasher.update(manifest.data(), manifest.size());
+        return hasher.finish();
+    }
+
+    // Hands a file's content to `sink` in pieces: a blob in one go, a
+    // chunked file one chunk at a time
+    void streamObject(const string& sha, const function<void(string_view)>& sink) {
+        ObjectView object = readObject(sha);
+        if (object.type() == "blob") {
+            sink(object.content());
+            return;
+        }
+        if (object.type() != "chunked") {
+            throw runtime_error("Not a blob object: " + sha);
+        }
+
+        string_view manifest = object.content();
+        size_t pos = manifest.find('\n');  // past "size <total>"
+        while (pos != string_view::npos && pos + 1 < manifest.size()) {
+            size_t eol = manifest.find('\n', pos + 1);
+            string_view line = manifest.substr(pos + 1, eol - pos - 1);
+            pos = eol;
+
+            size_t space = line.find(' ');
+            string chunk_sha(line.substr(0, space));
+            ObjectView chunk = readObject(chunk_sha, false);
+            if (space == string_view::npos || to_string(chunk.size()) != line.substr(space + 1)) {
+                throw runtime_error("Corrupt chunk list in " + sha);
+            }
+            sink(chunk.content());
+        }
+    }
+
+    // Maps the loose object and inflates just far enough to read the
+    // "<type> <size>\0" header, then inflates the rest in one call straight
+    // into a buffer of exactly the declared size. With `header_only`, stops
+    // after the header and returns null.
+    shared_ptr<ObjectData> readLooseObject(const string& sha, ObjectInfo* header_only = nullptr) {
+        if (sha.size() < 3) {
+            throw runtime_error("Object not found: " + sha);
+        }
+        string path = OBJECTS_DIR + "/" + sha.substr(0, 2) + "/" + sha.substr(2);
+
+        Trace::count(Trace::SYS_OPEN);
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) fd = openPendingObject(path);
+        if (fd < 0) {
+            throw runtime_error("Object not found: " + sha);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            throw runtime_error("Corrupt object: " + sha);
+        }
+        size_t map_size = st.st_size;
+        void* map = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            throw runtime_error("Cannot map object: " + sha);
+        }
+
+        z_stream strm{};
+        if (inflateInit(&strm) != Z_OK) {
+            munmap(map, map_size);
+            throw runtime_error("Decompression initialization failed");
+        }
+
+        try {
+            Trace::Span step("inflate", false);
+            auto object = inflateLoose(strm, static_cast<const unsigned char*>(map), map_size, sha,
+                                       header_only);
+            inflateEnd(&strm);
+            munmap(map, map_size);
+            return object;
+        } catch (...) {
+            inflateEnd(&strm);
+            munmap(map, map_size);
+            throw;
+        }
+    }
+
+    static shared_ptr<ObjectData> inflateLoose(z_stream& strm, const unsigned char* in, size_t in_size,
+                                               const string& sha, ObjectInfo* header_only) {
+        strm.next_in = (Bytef*)in;
+        strm.avail_in = in_size;
+
+        // The header is at most a type name, a 20-digit size and a NUL; any
+        // content that comes out with it is copied over below
+        unsigned char head[64];
+        strm.next_out = head;
+        strm.avail_out = sizeof(head);
+        int ret = inflate(&strm, Z_SYNC_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            throw runtime_error("Corrupt object: " + sha);
+        }
+
+        size_t have = sizeof(head) - strm.avail_out;
+        auto* nul = static_cast<unsigned char*>(memchr(head, '\0', have));
+        auto* space = static_cast<unsigned char*>(memchr(head, ' ', have));
+        if (!nul || !space || space > nul || nul == space + 1) {
+            throw runtime_error("Corrupt object header: " + sha);
+        }
+        uint64_t size = 0;
+        for (unsigned char* p = space + 1; p < nul; p++) {
+            if (*p < '0' || *p > '9' || size > (UINT64_MAX - 9) / 10) {
+                throw runtime_error("Corrupt object header: " + sha);
+            }
+            size = size * 10 + (*p - '0');
+        }
+
+        string_view type(reinterpret_cast<char*>(head), space - head);
+        if (header_only) {
+            *header_only = {objectTypeName(type), size};
+            return nullptr;
+        }
+        auto object = allocateObject(type, size);
+        size_t initial = have - (nul + 1 - head);
+        if (initial > size) {
+            throw runtime_error("Object size mismatch: " + sha);
+        }
+        memcpy(object->bytes.get(), nul + 1, initial);
+
+        strm.next_out = (Bytef*)object->bytes.get() + initial;
+        strm.avail_out = size - initial;
+        while (ret != Z_STREAM_END) {
+            if (strm.avail_out == 0) {
+                // Declared size reached: the stream must end without more output
+                unsigned char extra;
+                strm.next_out = &extra;
+                strm.avail_out = 1;
+                ret = inflate(&strm, Z_FINISH);
+                if (ret != Z_STREAM_END || strm.avail_out == 0) {
+                    throw runtime_error("Object size mismatch: " + sha);
+                }
+                return object;
+            }
+            ret = inflate(&strm, Z_FINISH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                throw runtime_error("Corrupt object: " + sha);
+            }
+            if (ret == Z_BUF_ERROR && strm.avail_out > 0) {
+                throw runtime_error("Truncated object: " + sha);
+            }
+        }
+        if (strm.avail_out != 0) {
+            throw runtime_error("Object size mismatch: " + sha);
+        }
+        return object;
+    }
+
+    // Packfiles (objects/pack/pack-<checksum>.pack) hold many objects in one
+    // file. Layout follows git's pack v2: "PACK" | version | count, then per
+    // object a type/size varint header and a zlib stream; ofs-delta entries
+    // carry a backwards offset to their base and a copy/insert delta. A
+    // SHA-1 of the whole pack trails it.
+    //
+    // The .idx companion (git's idx v2) is mmap'd once per process:
+    //   "\377tOc" | version 2 | fanout[256] u32 (objects with first byte <= i)
+    //   sorted sha1[20] table | CRC-32 per packed entry | offset u32 per entry
+    //   (MSB set: index into the following u64 table) | u64 offsets
+    //   pack checksum[20] | SHA-1 of everything above
+    // so a lookup is a fanout jump plus a binary search over the mapping.
+    enum PackType {
+        PACK_COMMIT = 1,
+        PACK_TREE = 2,
+        PACK_BLOB = 3,
+        PACK_CHUNKED = 5,  // code git leaves unused
+        PACK_OFS_DELTA = 6,
+    };
+
+    static constexpr char PACK_IDX_SIGNATURE[4] = {'\377', 't', 'O', 'c'};
+    static constexpr uint32_t PACK_IDX_VERSION = 2;
+    static constexpr size_t PACK_IDX_HEADER = 8 + 256 * 4;
+
+    struct Pack {
+        string path;  // without extension
+        const unsigned char* data = nullptr;
+        size_t size = 0;
+
+        const unsigned char* idx = nullptr;
+        size_t idx_size = 0;
+        uint32_t count = 0;
+        const unsigned char* fanout = nullptr;
+        const unsigned char* shas = nullptr;
+        const unsigned char* crcs = nullptr;
+        const unsigned char* offsets = nullptr;
+        const unsigned char* large_offsets = nullptr;
+
+        const unsigned char* sha(uint32_t i) const {
+            return shas + size_t(i) * SHA_DIGEST_LENGTH;
+        }
+
+        uint64_t offset(uint32_t i) const {
+            uint32_t small = getBE32(offsets + size_t(i) * 4);
+            if (!(small & 0x80000000u)) return small;
+            return getBE64(large_offsets + size_t(small & 0x7fffffffu) * 8);
+        }
+
+        ~Pack() {
+            if (data) munmap(const_cast<unsigned char*>(data), size);
+            if (idx) munmap(const_cast<unsigned char*>(idx), idx_size);
+        }
+    };
+
+    // objects/info/commit-graph: one fixed-width row per commit, parents
+    // before children, so new commits are appended without a rewrite.
+    //   "MGCG" | version u32 | row count u32
+    //   rows: commit sha1[20] | tree sha1[20] | parent positions u32 x 2
+    //         (0xffffffff = none) | timestamp u64 | generation u32
+    // The row count is updated only after a row is fully written, so a torn
+    // append is ignored by readers.
+    static constexpr char GRAPH_SIGNATURE[4] = {'M', 'G', 'C', 'G'};
+    static constexpr uint32_t GRAPH_VERSION = 1;
+    static constexpr size_t GRAPH_HEADER = 12;
+    static constexpr size_t GRAPH_ROW = 2 * SHA_DIGEST_LENGTH + 2 * 4 + 8 + 4;
+    static constexpr uint32_t GRAPH_NONE = 0xffffffff;
+
+    struct GraphRow {
+        ObjectId sha;
+        ObjectId tree;
+        uint32_t parents[2];
+        uint64_t timestamp;
+        uint32_t generation;
+    };
+
+    vector<GraphRow> graph_rows;
+    unordered_map<ObjectId, uint32_t, ObjectIdHash> graph_positions;
+    bool graph_loaded = false;
+
+    // objects/info/commit-graph-bloom: a Bloom filter per commit of the
+    // paths it changed against its parent, directories included, so a
+    // path-limited log skips most commits without reading a tree.
+    //   "MGBF" | version u32 | record count u32
+    //   records: commit sha1[20] | filter length u32 | filter
+    // Filters use BLOOM_BITS_PER_PATH bits per path and BLOOM_HASHES probes
+    // (murmur3 double hashing). An empty filter means no path changed; a
+    // commit changing more than BLOOM_MAX_PATHS paths gets one all-ones
+    // byte, which matches everything. Appends follow the commit-graph's
+    // torn-write rule.
+    static constexpr char BLOOM_SIGNATURE[4] = {'M', 'G', 'B', 'F'};
+    static constexpr uint32_t BLOOM_VERSION = 1;
+    static constexpr size_t BLOOM_HEADER = 12;
+    static constexpr size_t BLOOM_BITS_PER_PATH = 10;
+    static constexpr uint32_t BLOOM_HASHES = 7;
+    static constexpr size_t BLOOM_MAX_PATHS = 512;
+
+    string bloom_data;
+    unordered_map<ObjectId, string_view, ObjectIdHash> bloom_filters;  // views into bloom_data
+    bool bloom_loaded = false;
+
+    vector<unique_ptr<Pack>> packs;
+    bool packs_loaded = false;
+
+    // Where an object sits in a pack; keys the delta base cache
+    struct PackOffset {
+        const Pack* pack;
+        uint64_t offset;
+
+        bool operator==(const PackOffset& other) const {
+            return pack == other.pack && offset == other.offset;
+        }
+    };
+
+    struct PackOffsetHash {
+        size_t operator()(const PackOffset& key) const {
+            return hash<const void*>()(key.pack) ^ hash<uint64_t>()(key.offset);
+        }
+    };
+
+    // Inflated delta bases, so objects sharing a base (or a chain) do not
+    // each rebuild it. Cleared with the packs, whose addresses key it.
+    ObjectCache<PackOffset, PackOffsetHash> delta_base_cache{DEFAULT_DELTA_BASE_CACHE, Trace::DELTA_BASE_HITS,
+                                                             Trace::DELTA_BASE_MISSES};
+    mutex packs_mutex;
+
+    static int packTypeCode(string_view type) {
+        if (type == "commit") return PACK_COMMIT;
+        if (type == "tree") return PACK_TREE;
+        if (type == "blob") return PACK_BLOB;
+        if (type == "chunked") return PACK_CHUNKED;
+        throw runtime_error("Cannot pack object of type " + string(type));
+    }
+
+    static string_view packTypeName(int code) {
+        switch (code) {
+            case PACK_COMMIT: return "commit";
+            case PACK_TREE: return "tree";
+            case PACK_BLOB: return "blob";
+            case PACK_CHUNKED: return "chunked";
+            default: throw runtime_error("Unknown pack object type " + to_string(code));
+        }
+    }
+
+    // Inflates a zlib stream whose decompressed size is known up front.
+    // `avail` bounds how far the compressed stream may extend.
+    static void inflateExact(const unsigned char* in, size_t avail, char* out, size_t out_size) {
+        z_stream strm{};
+        if (inflateInit(&strm) != Z_OK) {
+            throw runtime_error("Decompression initialization failed");
+        }
+        strm.next_in = (Bytef*)in;
+        strm.avail_in = avail;
+        strm.next_out = (Bytef*)out;
+        strm.avail_out = out_size;
+        int ret = inflate(&strm, Z_FINISH);
+        inflateEnd(&strm);
+        if (ret != Z_STREAM_END || strm.avail_out != 0) {
+            throw runtime_error("Corrupt compressed data in pack");
+        }
+    }
+
+    static void putVarint(string& out, uint64_t v) {
+        while (v >= 0x80) {
+            out.push_back(char(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back(char(v));
+    }
+
+    static uint64_t getVarint(const unsigned char*& p, const unsigned char* end) {
+        uint64_t v = 0;
+        int shift = 0;
+        while (p < end && shift < 64) {
+            unsigned char c = *p++;
+            v |= uint64_t(c & 0x7f) << shift;
+            if (!(c & 0x80)) return v;
+            shift += 7;
+        }
+        throw runtime_error("Corrupt delta header");
+    }
+
+    static void putPackObjectHeader(string& out, int type, uint64_t size) {
+        unsigned char c = (type << 4) | (size & 0x0f);
+        size >>= 4;
+        while (size) {
+            out.push_back(char(c | 0x80));
+            c = size & 0x7f;
+            size >>= 7;
+        }
+        out.push_back(char(c));
+    }
+
+    static void putDeltaOffset(string& out, uint64_t ofs) {
+        unsigned char buf[16];
+        int pos = sizeof(buf) - 1;
+        buf[pos] = ofs & 0x7f;
+        while (ofs >>= 7) {
+            buf[--pos] = 0x80 | (--ofs & 0x7f);
+        }
+        out.append(reinterpret_cast<char*>(buf + pos), sizeof(buf) - pos);
+    }
+
+    static uint32_t deltaNameHash(string_view name) {
+        uint32_t hash = 0;
+        for (unsigned char c : name) {
+            if (isspace(c)) continue;
+            hash = (hash >> 2) + (uint32_t(c) << 24);
+        }
+        return hash;
+    }
+
+    // Encodes target as copy/insert instructions against base (git's delta
+    // format). Returns false if the delta would exceed max_size.
+    static bool createDelta(string_view base, string_view target, size_t max_size, string& delta) {
+        const size_t BLOCK = 16;
+        const uint32_t MULT = 0x01000193;
+
+        delta.clear();
+        putVarint(delta, base.size());
+        putVarint(delta, target.size());
+        if (base.size() < BLOCK || base.size() > UINT32_MAX) return false;
+
+        auto hashBlock = [&](const unsigned char* p) {
+            uint32_t h = 0;
+            for (size_t k = 0; k < BLOCK; k++) h = h * MULT + p[k];
+            return h;
+        };
+        uint32_t out_factor = 1;  // MULT^(BLOCK-1), to roll a byte out
+        for (size_t k = 1; k < BLOCK; k++) out_factor *= MULT;
+
+        // Hash table of aligned base blocks; later blocks win on collision
+        size_t slots = 1;
+        while (slots < base.size() / BLOCK * 2) slots <<= 1;
+        vector<uint32_t> table(slots, 0);  // offset + 1, 0 = empty
+        const auto* b = reinterpret_cast<const unsigned char*>(base.data());
+        for (size_t off = 0; off + BLOCK <= base.size(); off += BLOCK) {
+            table[hashBlock(b + off) & (slots - 1)] = uint32_t(off + 1);
+        }
+
+        string insert;
+        auto flushInsert = [&] {
+            if (insert.empty()) return;
+            delta.push_back(char(insert.size()));
+            delta += insert;
+            insert.clear();
+        };
+
+        const auto* t = reinterpret_cast<const unsigned char*>(target.data());
+        size_t n = target.size();
+        size_t i = 0;
+        uint32_t h = 0;
+        bool h_valid = false;
+        while (i < n) {
+            size_t match_off = 0, match_len = 0;
+            if (i + BLOCK <= n) {
+                if (!h_valid) {
+                    h = hashBlock(t + i);
+                    h_valid = true;
+                }
+                uint32_t slot = table[h & (slots - 1)];
+                if (slot && memcmp(b + slot - 1, t + i, BLOCK) == 0) {
+                    match_off = slot - 1;
+                    match_len = BLOCK;
+                    while (match_off + match_len < base.size() && i + match_len < n &&
+                           b[match_off + match_len] == t[i + match_len]) {
+                        match_len++;
+                    }
+                }
+            }
+
+            if (match_len == 0) {
+                insert.push_back(char(t[i]));
+                if (insert.size() == 0x7f) flushInsert();
+                if (h_valid && i + BLOCK < n) {
+                    h = (h - t[i] * out_factor) * MULT + t[i + BLOCK];
+                } else {
+                    h_valid = false;
+                }
+                i++;
+            } else {
+                size_t next = i + match_len;
+                // Grow the copy backwards over bytes still waiting to be inserted
+                while (!insert.empty() && match_off > 0 &&
+                       b[match_off - 1] == static_cast<unsigned char>(insert.back())) {
+                    insert.pop_back();
+                    match_off--;
+                    match_len++;
+                }
+                flushInsert();
+                while (match_len > 0) {
+                    size_t len = min<size_t>(match_len, 0xffffff);
+                    unsigned char cmd = 0x80;
+                    string args;
+                    for (int k = 0; k < 4; k++) {
+                        unsigned char byte = (match_off >> (8 * k)) & 0xff;
+                        if (byte) {
+                            cmd |= 1 << k;
+                            args.push_back(char(byte));
+                        }
+                    }
+                    for (int k = 0; k < 3; k++) {
+                        unsigned char byte = (len >> (8 * k)) & 0xff;
+                        if (byte) {
+                            cmd |= 0x10 << k;
+                            args.push_back(char(byte));
+                        }
+                    }
+                    delta.push_back(char(cmd));
+                    delta += args;
+                    match_off += len;
+                    match_len -= len;
+                }
+                i = next;
+                h_valid = false;
+            }
+
+            if (delta.size() + insert.size() > max_size) return false;
+        }
+        flushInsert();
+        return delta.size() <= max_size;
+    }
+
+    static shared_ptr<ObjectData> applyDelta(const ObjectData& base, const char* delta, size_t delta_size) {
+        const auto* p = reinterpret_cast<const unsigned char*>(delta);
+        const auto* end = p + delta_size;
+        if (getVarint(p, end) != base.size) {
+            throw runtime_error("Delta base size mismatch");
+        }
+        auto object = allocateObject(base.type, getVarint(p, end));
+        char* result = object->bytes.get();
+
+        size_t out = 0;
+        while (p < end) {
+            unsigned char cmd = *p++;
+            if (cmd & 0x80) {
+                uint64_t off = 0, len = 0;
+                for (int k = 0; k < 4; k++) {
+                    if (cmd & (1 << k)) {
+                        if (p >= end) throw runtime_error("Corrupt delta");
+                        off |= uint64_t(*p++) << (8 * k);
+                    }
+                }
+                for (int k = 0; k < 3; k++) {
+                    if (cmd & (0x10 << k)) {
+                        if (p >= end) throw runtime_error("Corrupt delta");
+                        len |= uint64_t(*p++) << (8 * k);
+                    }
+                }
+                if (len == 0) len = 0x10000;
+                if (off + len > base.size || out + len > object->size) {
+                    throw runtime_error("Corrupt delta");
+                }
+                memcpy(result + out, base.bytes.get() + off, len);
+                out += len;
+            } else if (cmd) {
+                if (p + cmd > end || out + cmd > object->size) {
+                    throw runtime_error("Corrupt delta");
+                }
+                memcpy(result + out, p, cmd);
+                p += cmd;
+                out += cmd;
+            } else {
+                throw runtime_error("Corrupt delta");
+            }
+        }
+        if (out != object->size) {
+            throw runtime_error("Delta result size mismatch");
+        }
+        return object;
+    }
+
+    static const unsigned char* mapFile(const string& path, size_t& size) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("Cannot open " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            throw runtime_error("Cannot read " + path);
+        }
+        void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            throw runtime_error("Cannot map " + path);
+        }
+        size = st.st_size;
+        return static_cast<const unsigned char*>(map);
+    }
+
+    unique_ptr<Pack> openPack(const string& path) {
+        auto pack = make_unique<Pack>();
+        pack->path = path;
+
+        pack->idx = mapFile(path + ".idx", pack->idx_size);
+        const unsigned char* d = pack->idx;
+        size_t size = pack->idx_size;
+        if (size < PACK_IDX_HEADER + 2 * SHA_DIGEST_LENGTH || memcmp(d, PACK_IDX_SIGNATURE, 4) != 0 ||
+            getBE32(d + 4) != PACK_IDX_VERSION) {
+            throw runtime_error("Bad pack index: " + path + ".idx");
+        }
+
+        pack->fanout = d + 8;
+        pack->count = getBE32(pack->fanout + 255 * 4);
+        size_t n = pack->count;
+        pack->shas = d + PACK_IDX_HEADER;
+        pack->crcs = pack->shas + n * SHA_DIGEST_LENGTH;
+        pack->offsets = pack->crcs + n * 4;
+        pack->large_offsets = pack->offsets + n * 4;
+        size_t min_size = PACK_IDX_HEADER + n * (SHA_DIGEST_LENGTH + 8) + 2 * SHA_DIGEST_LENGTH;
+        if (size < min_size || (size - min_size) % 8 != 0) {
+            throw runtime_error("Bad pack index: " + path + ".idx");
+        }
+
+        // Lookups trust the fanout ranges and large-offset indexes, so a
+        // decreasing fanout (its last entry is the count checked against
+        // the pack below) or an index past the table is rejected here
+        for (int i = 1; i < 256; i++) {
+            if (getBE32(pack->fanout + i * 4) < getBE32(pack->fanout + (i - 1) * 4)) {
+                throw runtime_error("Bad pack index fanout: " + path + ".idx");
+            }
+        }
+        size_t large_count = (size - min_size) / 8;
+        for (size_t i = 0; i < n; i++) {
+            uint32_t small = getBE32(pack->offsets + i * 4);
+            if ((small & 0x80000000u) && (small & 0x7fffffffu) >= large_count) {
+                throw runtime_error("Bad pack index offset: " + path + ".idx");
+            }
+        }
+
+        pack->data = mapFile(path + ".pack", pack->size);
+        if (pack->size < 12 + SHA_DIGEST_LENGTH || memcmp(pack->data, "PACK", 4) != 0 ||
+            getBE32(pack->data + 4) != 2 || getBE32(pack->data + 8) != pack->count ||
+            memcmp(pack->data + pack->size - SHA_DIGEST_LENGTH,
+                   d + size - 2 * SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH) != 0) {
+            throw runtime_error("Pack does not match its index: " + path + ".pack");
+        }
+        return pack;
+    }
+
+    void loadPacks() {
+        lock_guard<mutex> lock(packs_mutex);
+        if (packs_loaded) return;
+        packs_loaded = true;
+
+        string pack_dir = OBJECTS_DIR + "/pack";
+        if (!fs::is_directory(pack_dir)) return;
+
+        vector<string> paths;
+        for (const auto& entry : fs::directory_iterator(pack_dir)) {
+            if (entry.path().extension() == ".idx") {
+                fs::path base = entry.path();
+                paths.push_back(base.replace_extension().string());
+            }
+        }
+        sort(paths.begin(), paths.end());
+        for (const auto& path : paths) {
+            packs.push_back(openPack(path));
+        }
+    }
+
+    void unloadPacks() {
+        lock_guard<mutex> lock(packs_mutex);
+        packs.clear();
+        packs_loaded = false;
+        delta_base_cache.clear();
+    }
+
+    // Fanout jump to the run of SHAs sharing the first byte, then binary
+    // search within it. No allocation.
+    static bool findPackEntry(const Pack& pack, const unsigned char* sha1, uint64_t& offset) {
+        uint32_t lo = sha1[0] ? getBE32(pack.fanout + (sha1[0] - 1) * 4) : 0;
+        uint32_t hi = getBE32(pack.fanout + sha1[0] * 4);
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            int cmp = memcmp(pack.sha(mid), sha1, SHA_DIGEST_LENGTH);
+            if (cmp == 0) {
+                offset = pack.offset(mid);
+                return true;
+            }
+            if (cmp < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return false;
+    }
+
+    struct PackEntryHeader {
+        int type;
+        uint64_t size;          // inflated size of the data (the delta, for deltas)
+        uint64_t base_offset;   // for PACK_OFS_DELTA
+        const unsigned char* data;
+    };
+
+    static PackEntryHeader parsePackEntryHeader(const Pack& pack, uint64_t offset) {
+        if (offset >= pack.size - SHA_DIGEST_LENGTH) {
+            throw runtime_error("Bad pack offset in " + pack.path + ".pack");
+        }
+        const unsigned char* p = pack.data + offset;
+        const unsigned char* end = pack.data + pack.size - SHA_DIGEST_LENGTH;
+
+        PackEntryHeader header{};
+        unsigned char c = *p++;
+        header.type = (c >> 4) & 7;
+        header.size = c & 0x0f;
+        for (int shift = 4; c & 0x80; shift += 7) {
+            // Past bit 57 a further 7-bit group no longer fits in 64 bits
+            if (p >= end || shift > 57) throw runtime_error("Corrupt pack entry header");
+            c = *p++;
+            header.size |= uint64_t(c & 0x7f) << shift;
+        }
+
+        if (header.type == PACK_OFS_DELTA) {
+            if (p >= end) throw runtime_error("Corrupt pack entry header");
+            c = *p++;
+            uint64_t distance = c & 0x7f;
+            while (c & 0x80) {
+                if (p >= end || distance >= (uint64_t(1) << 57) - 1) throw runtime_error("Corrupt pack entry header");
+                c = *p++;
+                distance = ((distance + 1) << 7) | (c & 0x7f);
+            }
+            if (distance == 0 || distance > offset) {
+                throw runtime_error("Corrupt delta base offset");
+            }
+            header.base_offset = offset - distance;
+        }
+        header.data = p;
+        return header;
+    }
+
+    shared_ptr<ObjectData> readPackedObject(const Pack& pack, uint64_t offset) {
+        PackEntryHeader header = parsePackEntryHeader(pack, offset);
+        size_t avail = pack.data + pack.size - SHA_DIGEST_LENGTH - header.data;
+
+        if (header.type != PACK_OFS_DELTA) {
+            auto object = allocateObject(packTypeName(header.type), header.size);
+            inflateExact(header.data, avail, object->bytes.get(), header.size);
+            return object;
+        }
+
+        auto base = readDeltaBase(pack, header.base_offset);
+        unique_ptr<char[]> delta(new char[max<uint64_t>(header.size, 1)]);
+        inflateExact(header.data, avail, delta.get(), header.size);
+        return applyDelta(*base, delta.get(), header.size);
+    }
+
+    shared_ptr<const ObjectData> readDeltaBase(const Pack& pack, uint64_t offset) {
+        PackOffset key{&pack, offset};
+        shared_ptr<const ObjectData> base = delta_base_cache.get(key);
+        if (!base) {
+            base = readPackedObject(pack, offset);
+            delta_base_cache.put(key, base);
+        }
+        return base;
+    }
+
+    shared_ptr<ObjectData> readObjectFromPacks(const unsigned char* raw) {
+        loadPacks();
+        for (const auto& pack : packs) {
+            uint64_t offset;
+            if (findPackEntry(*pack, raw, offset)) {
+                Trace::Span step("inflate", false);
+                return readPackedObject(*pack, offset);
+            }
+        }
+        return nullptr;
+    }
+
+    // The type comes from the end of the delta chain; a delta's result
+    // size is the second varint at the start of the delta, so only a few
+    // bytes of it are inflated
+    bool packedObjectInfo(const unsigned char* raw, ObjectInfo& info) {
+        loadPacks();
+        for (const auto& pack : packs) {
+            uint64_t offset;
+            if (!findPackEntry(*pack, raw, offset)) continue;
+
+            PackEntryHeader header = parsePackEntryHeader(*pack, offset);
+            if (header.type != PACK_OFS_DELTA) {
+                info = {packTypeName(header.type), header.size};
+                return true;
+            }
+
+            unsigned char prefix[20];
+            z_stream strm{};
+            if (inflateInit(&strm) != Z_OK) {
+                throw runtime_error("Decompression initialization failed");
+            }
+            strm.next_in = (Bytef*)header.data;
+            strm.avail_in = pack->data + pack->size - SHA_DIGEST_LENGTH - header.data;
+            strm.next_out = prefix;
+            strm.avail_out = min<uint64_t>(sizeof(prefix), header.size);
+            inflate(&strm, Z_SYNC_FLUSH);
+            const unsigned char* p = prefix;
+            const unsigned char* end = strm.next_out;
+            inflateEnd(&strm);
+            getVarint(p, end);  // base size
+            info.size = getVarint(p, end);
+
+            while (header.type == PACK_OFS_DELTA) {
+                header = parsePackEntryHeader(*pack, header.base_offset);
+            }
+            info.type = packTypeName(header.type);
+            return true;
+        }
+        return false;
+    }
+
+    vector<string> looseObjects() {
+        vector<string> shas;
+        if (!fs::is_directory(OBJECTS_DIR)) return shas;
+        for (const auto& dir : fs::directory_iterator(OBJECTS_DIR)) {
+            string prefix = dir.path().filename().string();
+            if (prefix.size() != 2 || !dir.is_directory()) continue;
+            for (const auto& file : fs::directory_iterator(dir.path())) {
+                string sha = prefix + file.path().filename().string();
+                unsigned char raw[SHA_DIGEST_LENGTH];
+                if (fromHex(sha, raw)) shas.push_back(sha);
+            }
+        }
+        return shas;
+    }
+
+    void loadCommitGraph() {
+        if (graph_loaded) return;
+        graph_loaded = true;
+        graph_rows.clear();
+        graph_positions.clear();
+
+        ifstream file(COMMIT_GRAPH_FILE, ios::binary);
+        if (!file) return;
+        stringstream buffer;
+        buffer << file.rdbuf();
+        string data = buffer.str();
+        const auto* d = reinterpret_cast<const unsigned char*>(data.data());
+        if (data.size() < GRAPH_HEADER || memcmp(d, GRAPH_SIGNATURE, 4) != 0 ||
+            getBE32(d + 4) != GRAPH_VERSION) {
+            return;  // Unusable graph: everything falls back to the objects
+        }
+
+        uint32_t count = getBE32(d + 8);
+        if (data.size() < GRAPH_HEADER + size_t(count) * GRAPH_ROW) {
+            return;
+        }
+        graph_rows.resize(count);
+        graph_positions.reserve(count);
+        for (uint32_t i = 0; i < count; i++) {
+            const unsigned char* p = d + GRAPH_HEADER + size_t(i) * GRAPH_ROW;
+            GraphRow& row = graph_rows[i];
+            memcpy(row.sha.data(), p, SHA_DIGEST_LENGTH);
+            memcpy(row.tree.data(), p + SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH);
+            row.parents[0] = getBE32(p + 40);
+            row.parents[1] = getBE32(p + 44);
+            row.timestamp = getBE64(p + 48);
+            row.generation = getBE32(p + 56);
+            graph_positions[row.sha] = i;
+        }
+    }
+
+    bool graphPosition(string_view sha, uint32_t& pos) {
+        loadCommitGraph();
+        ObjectId id;
+        if (!fromHex(sha, id.data())) return false;
+        auto it = graph_positions.find(id);
+        if (it == graph_positions.end()) return false;
+        pos = it->second;
+        return true;
+    }
+
+    static string encodeGraphRow(const GraphRow& row) {
+        string out(reinterpret_cast<const char*>(row.sha.data()), SHA_DIGEST_LENGTH);
+        out.append(reinterpret_cast<const char*>(row.tree.data()), SHA_DIGEST_LENGTH);
+        putBE32(out, row.parents[0]);
+        putBE32(out, row.parents[1]);
+        putBE64(out, row.timestamp);
+        putBE32(out, row.generation);
+        return out;
+    }
+
+    GraphRow makeGraphRow(const string& sha, const CommitView& commit, uint32_t parent) const {
+        GraphRow row{};
+        fromHex(sha, row.sha.data());
+        fromHex(commit.tree(), row.tree.data());
+        row.parents[0] = parent;
+        row.parents[1] = GRAPH_NONE;
+        row.timestamp = commit.timestamp();
+        row.generation = parent == GRAPH_NONE ? 1 : graph_rows[parent].generation + 1;
+        return row;
+    }
+
+    // Adds a new commit to the graph if its parent is already covered (or
+    // it has none); otherwise the next gc picks it up
+    void appendCommitGraph(const string& sha, const CommitView& commit) {
+        loadCommitGraph();
+
+        uint32_t parent = GRAPH_NONE;
+        if (!commit.parent().empty() && !graphPosition(commit.parent(), parent)) return;
+        uint32_t existing;
+        if (graphPosition(sha, existing)) return;
+
+        GraphRow row = makeGraphRow(sha, commit, parent);
+        uint32_t count = graph_rows.size();
+
+        fs::create_directories(fs::path(COMMIT_GRAPH_FILE).parent_path());
+        int fd = open(COMMIT_GRAPH_FILE.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return;  // The graph is only an accelerator
+        string header(GRAPH_SIGNATURE, 4);
+        putBE32(header, GRAPH_VERSION);
+        putBE32(header, count + 1);
+        string encoded = encodeGraphRow(row);
+        bool ok = pwrite(fd, encoded.data(), encoded.size(), GRAPH_HEADER + off_t(count) * GRAPH_ROW) ==
+                      ssize_t(encoded.size()) &&
+                  pwrite(fd, header.data(), header.size(), 0) == ssize_t(header.size());
+        close(fd);
+
+        if (ok) {
+            graph_positions[row.sha] = count;
+            graph_rows.push_back(row);
+        }
+    }
+
+    // HEAD and every branch tip
+    vector<string> refTips() {
+        vector<string> tips;
+        string head_sha = headCommit();
+        if (!head_sha.empty()) tips.push_back(head_sha);
+        if (fs::is_directory(REFS_DIR)) {
+            for (const auto& entry : fs::recursive_directory_iterator(REFS_DIR)) {
+                if (!entry.is_regular_file()) continue;
+                ifstream ref_file(entry.path());
+                string sha;
+                getline(ref_file, sha);
+                if (!sha.empty()) tips.push_back(sha);
+            }
+        }
+        return tips;
+    }
+
+    // Rebuilds the graph from every branch tip and HEAD
+    size_t writeCommitGraph() {
+        vector<string> tips = refTips();
+
+        // Post-order walk so every parent gets its row before its children
+        graph_rows.clear();
+        graph_positions.clear();
+        graph_loaded = true;
+        map<string, CommitView> commits;
+        vector<pair<string, bool>> stack;
+        for (const auto& tip : tips) stack.push_back({tip, false});
+        while (!stack.empty()) {
+            auto [sha, expanded] = stack.back();
+            stack.pop_back();
+            ObjectId id;
+            if (!fromHex(sha, id.data()) || graph_positions.count(id)) continue;
+
+            if (!expanded) {
+                if (commits.count(sha)) continue;  // Already on the stack
+                ObjectView object = readObject(sha);
+                if (object.type() != "commit") continue;
+                CommitView commit(object);
+                stack.push_back({sha, true});
+                if (!commit.parent().empty()) stack.push_back({string(commit.parent()), false});
+                commits.emplace(sha, move(commit));
+                continue;
+            }
+
+            const CommitView& commit = commits.at(sha);
+            uint32_t parent = GRAPH_NONE;
+            if (!commit.parent().empty() && !graphPosition(commit.parent(), parent)) {
+                throw runtime_error("Parent of " + sha + " is not a commit");
+            }
+            graph_positions[id] = graph_rows.size();
+            graph_rows.push_back(makeGraphRow(sha, commit, parent));
+        }
+
+        string out(GRAPH_SIGNATURE, 4);
+        putBE32(out, GRAPH_VERSION);
+        putBE32(out, graph_rows.size());
+        for (const auto& row : graph_rows) out += encodeGraphRow(row);
+
+        fs::create_directories(fs::path(COMMIT_GRAPH_FILE).parent_path());
+        string tmp_path = COMMIT_GRAPH_FILE + ".lock";
+        {
+            ofstream file(tmp_path, ios::binary | ios::trunc);
+            file.write(out.data(), out.size());
+            if (!file) {
+                throw runtime_error("Failed to write commit-graph");
+            }
+        }
+        fs::rename(tmp_path, COMMIT_GRAPH_FILE);
+        return graph_rows.size();
+    }
+
+    static uint32_t murmur3(string_view data, uint32_t seed) {
+        const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593;
+        auto rotl = [](uint32_t x, int r) { return (x << r) | (x >> (32 - r)); };
+        uint32_t h = seed;
+        size_t blocks = data.size() / 4;
+        for (size_t i = 0; i < blocks; i++) {
+            uint32_t k;
+            memcpy(&k, data.data() + i * 4, 4);
+            h ^= rotl(k * c1, 15) * c2;
+            h = rotl(h, 13) * 5 + 0xe6546b64;
+        }
+        uint32_t k = 0;
+        const auto* tail = reinterpret_cast<const unsigned char*>(data.data()) + blocks * 4;
+        switch (data.size() & 3) {
+            case 3: k ^= uint32_t(tail[2]) << 16; [[fallthrough]];
+            case 2: k ^= uint32_t(tail[1]) << 8; [[fallthrough]];
+            case 1: k ^= tail[0]; h ^= rotl(k * c1, 15) * c2;
+        }
+        h ^= uint32_t(data.size());
+        h ^= h >> 16;
+        h *= 0x85ebca6b;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35;
+        return h ^ (h >> 16);
+    }
+
+    // Calls `bit` with each of the path's BLOOM_HASHES bit positions
+    template <typename F>
+    static void bloomBits(string_view path, size_t filter_bits, F bit) {
+        uint32_t h0 = murmur3(path, 0x293ae76f), h1 = murmur3(path, 0x7e646e2c);
+        for (uint32_t i = 0; i < BLOOM_HASHES; i++) {
+            bit((h0 + i * h1) % filter_bits);
+        }
+    }
+
+    static string makeBloomFilter(const set<string>* paths) {
+        if (!paths) return string(1, '\xff');
+        string filter((paths->size() * BLOOM_BITS_PER_PATH + 7) / 8, '\0');
+        for (const auto& path : *paths) {
+            bloomBits(path, filter.size() * 8, [&](size_t b) { filter[b / 8] |= char(1 << (b % 8)); });
+        }
+        return filter;
+    }
+
+    static bool bloomMaybeContains(string_view filter, string_view path) {
+        if (filter.empty()) return false;
+        bool all = true;
+        bloomBits(path, filter.size() * 8, [&](size_t b) {
+            if (!(filter[b / 8] & (1 << (b % 8)))) all = false;
+        });
+        return all;
+    }
+
+    void loadBloomFilters() {
+        if (bloom_loaded) return;
+        bloom_loaded = true;
+        bloom_filters.clear();
+        bloom_data.clear();
+
+        ifstream file(BLOOM_FILE, ios::binary);
+        if (!file) return;
+        stringstream buffer;
+        buffer << file.rdbuf();
+        bloom_data = buffer.str();
+        const auto* d = reinterpret_cast<const unsigned char*>(bloom_data.data());
+        if (bloom_data.size() < BLOOM_HEADER || memcmp(d, BLOOM_SIGNATURE, 4) != 0 ||
+            getBE32(d + 4) != BLOOM_VERSION) {
+            bloom_data.clear();
+            return;  // Unusable: path-limited log diffs every commit
+        }
+
+        uint32_t count = getBE32(d + 8);
+        size_t pos = BLOOM_HEADER;
+        for (uint32_t i = 0; i < count; i++) {
+            if (pos + SHA_DIGEST_LENGTH + 4 > bloom_data.size()) break;
+            ObjectId id;
+            memcpy(id.data(), d + pos, SHA_DIGEST_LENGTH);
+            size_t length = getBE32(d + pos + SHA_DIGEST_LENGTH);
+            pos += SHA_DIGEST_LENGTH + 4;
+            if (pos + length > bloom_data.size()) break;
+            bloom_filters[id] = string_view(bloom_data.data() + pos, length);
+            pos += length;
+        }
+        bloom_data.resize(pos);  // Drops a torn record; appends go here
+    }
+
+    const string_view* bloomFilter(const ObjectId& commit) {
+        loadBloomFilters();
+        auto it = bloom_filters.find(commit);
+        return it == bloom_filters.end() ? nullptr : &it->second;
+    }
+
+    // Adds every path under tree `sha` to `out`; false once it would pass
+    // BLOOM_MAX_PATHS
+    bool collectPaths(const string& sha, const string& prefix, set<string>& out) {
+        for (const auto& entry : TreeView(readObject(sha))) {
+            string path = childPath(prefix, string(entry.name));
+            out.insert(path);
+            if (out.size() > BLOOM_MAX_PATHS) return false;
+            if (entry.isTree() && !collectPaths(entry.hex(), path, out)) return false;
+        }
+        return true;
+    }
+
+    // Paths that differ between two trees ("" = empty tree), with every
+    // directory above a change. Subtrees with equal SHAs are not read.
+    // False once the set would pass BLOOM_MAX_PATHS.
+    bool changedPaths(const string& from, const string& to, const string& prefix, set<string>& out) {
+        if (from.empty()) return collectPaths(to, prefix, out);
+        ObjectView from_tree = readObject(from), to_tree = readObject(to);
+        map<string_view, TreeEntry> old_entries;
+        for (const auto& entry : TreeView(from_tree)) old_entries[entry.name] = entry;
+
+        for (const auto& entry : TreeView(to_tree)) {
+            string path = childPath(prefix, string(entry.name));
+            auto old_it = old_entries.find(entry.name);
+            if (old_it != old_entries.end()) {
+                TreeEntry old_entry = old_it->second;
+                old_entries.erase(old_it);
+                if (old_entry.sha == entry.sha && old_entry.mode == entry.mode) continue;
+                out.insert(path);
+                if (out.size() > BLOOM_MAX_PATHS) return false;
+                if (entry.isTree() && old_entry.isTree()) {
+                    if (!changedPaths(old_entry.hex(), entry.hex(), path, out)) return false;
+                    continue;
+                }
+                if (old_entry.isTree() && !collectPaths(old_entry.hex(), path, out)) return false;
+            } else {
+                out.insert(path);
+                if (out.size() > BLOOM_MAX_PATHS) return false;
+            }
+            if (entry.isTree() && !collectPaths(entry.hex(), path, out)) return false;
+        }
+        for (const auto& [name, old_entry] : old_entries) {
+            string path = childPath(prefix, string(name));
+            out.insert(path);
+            if (out.size() > BLOOM_MAX_PATHS) return false;
+            if (old_entry.isTree() && !collectPaths(old_entry.hex(), path, out)) return false;
+        }
+        return true;
+    }
+
+    string computeBloomFilter(const string& parent_tree, const string& tree) {
+        set<string> paths;
+        bool fits = changedPaths(parent_tree, tree, "", paths);
+        return makeBloomFilter(fits ? &paths : nullptr);
+    }
+
+    static string encodeBloomRecord(const ObjectId& commit, const string& filter) {
+        string out(reinterpret_cast<const char*>(commit.data()), SHA_DIGEST_LENGTH);
+        putBE32(out, filter.size());
+        return out + filter;
+    }
+
+    // Records the new commit's filter; failures only cost speed
+    void appendBloomFilter(const string& sha, const string& parent_tree, const string& tree) {
+        loadBloomFilters();
+        ObjectId id;
+        if (!fromHex(sha, id.data()) || bloom_filters.count(id)) return;
+        string record = encodeBloomRecord(id, computeBloomFilter(parent_tree, tree));
+
+        fs::create_directories(fs::path(BLOOM_FILE).parent_path());
+        int fd = open(BLOOM_FILE.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return;
+        size_t offset = max(bloom_data.size(), BLOOM_HEADER);
+        string header(BLOOM_SIGNATURE, 4);
+        putBE32(header, BLOOM_VERSION);
+        putBE32(header, bloom_filters.size() + 1);
+        bool ok = pwrite(fd, record.data(), record.size(), offset) == ssize_t(record.size()) &&
+                  pwrite(fd, header.data(), header.size(), 0) == ssize_t(header.size());
+        close(fd);
+
+        // Views into bloom_data must stay valid, so re-read on next use
+        if (ok) bloom_loaded = false;
+    }
+
+    // Rewrites the filter file for the commits in the graph, keeping
+    // existing filters and computing the missing ones (commits from before
+    // filters existed) in parallel
+    size_t writeBloomFilters() {
+        loadBloomFilters();
+        vector<string> filters(graph_rows.size());
+        {
+            ThreadPool pool(workerCount());
+            for (size_t i = 0; i < graph_rows.size(); i++) {
+                if (const string_view* existing = bloomFilter(graph_rows[i].sha)) {
+                    filters[i] = string(*existing);
+                    continue;
+                }
+                pool.submit([&, i] {
+                    uint32_t parent = graph_rows[i].parents[0];
+                    string parent_tree = parent == GRAPH_NONE ? "" : toHex(graph_rows[parent].tree.data());
+                    filters[i] = computeBloomFilter(parent_tree, toHex(graph_rows[i].tree.data()));
+                });
+            }
+            pool.wait();
+        }
+
+        string out(BLOOM_SIGNATURE, 4);
+        putBE32(out, BLOOM_VERSION);
+        putBE32(out, graph_rows.size());
+        for (size_t i = 0; i < graph_rows.size(); i++) {
+            out += encodeBloomRecord(graph_rows[i].sha, filters[i]);
+        }
+
+        string tmp_path = BLOOM_FILE + ".lock";
+        {
+            ofstream file(tmp_path, ios::binary | ios::trunc);
+            file.write(out.data(), out.size());
+            if (!file) {
+                throw runtime_error("Failed to write commit-graph-bloom");
+            }
+        }
+        fs::rename(tmp_path, BLOOM_FILE);
+        bloom_loaded = false;
+        return graph_rows.size();
+    }
+
+    void loadIndex() {
+        if (index_loaded) return;
+        index_loaded = true;
+        Trace::Span span("loadIndex");
+        index.clear();
+        cache_tree.clear();
+        fsmonitor_token.clear();
+        fsmonitor_dirs.clear();
+
+        int fd = open(INDEX_FILE.c_str(), O_RDONLY);
+        if (fd < 0) return;  // No index yet
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return;
+        }
+        size_t size = st.st_size;
+        void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            throw runtime_error("Cannot map index file");
+        }
+
+        // Entries modified in the same instant the index was written are
+        // "racy": their stat data cannot prove the content is unchanged.
+        index_mtime_ns = toNs(st.st_mtim);
+        try {
+            parseIndex(static_cast<const unsigned char*>(map), size);
+        } catch (...) {
+            munmap(map, size);
+            throw;
+        }
+        munmap(map, size);
+    }
+
+    void parseIndex(const unsigned char* data, size_t size) {
+        // Anything without our signature is a pre-binary index; it carried no
+        // stat data, so start from an empty cache and rebuild it.
+        if (size < 12 + SHA_DIGEST_LENGTH || memcmp(data, INDEX_SIGNATURE, 4) != 0) {
+            return;
+        }
+
+        size_t body = size - SHA_DIGEST_LENGTH;
+        unsigned char checksum[SHA_DIGEST_LENGTH];
+        Hasher::hash(data, body, checksum);
+        if (memcmp(checksum, data + body, SHA_DIGEST_LENGTH) != 0) {
+            throw runtime_error("Index file is corrupt (bad checksum)");
+        }
+
+        uint32_t version = getBE32(data + 4);
+        if (version != INDEX_VERSION) {
+            throw runtime_error("Unsupported index version " + to_string(version));
+        }
+
+        uint32_t count = getBE32(data + 8);
+        index.reserve(count);
+        size_t pos = 12;
+        for (uint32_t i = 0; i < count; i++) {
+            if (pos + INDEX_ENTRY_FIXED > body) {
+                throw runtime_error("Index file is truncated");
+            }
+            const unsigned char* p = data + pos;
+            IndexEntry entry;
+            entry.mtime_ns = getBE64(p);
+            entry.ctime_ns = getBE64(p + 8);
+            entry.size = getBE64(p + 16);
+            entry.ino = getBE64(p + 24);
+            entry.dev = getBE64(p + 32);
+            entry.mode = getBE32(p + 40);
+            memcpy(entry.sha1, p + 44, SHA_DIGEST_LENGTH);
+            uint16_t path_len = getBE16(p + 44 + SHA_DIGEST_LENGTH);
+
+            size_t entry_len = (INDEX_ENTRY_FIXED + path_len + 7) & ~size_t(7);
+            if (pos + entry_len > body) {
+                throw runtime_error("Index file is truncated");
+            }
+            entry.path.assign(reinterpret_cast<const char*>(p + INDEX_ENTRY_FIXED), path_len);
+            index.push_back(move(entry));
+            pos += entry_len;
+        }
+
+        // Extensions; unknown ones are skipped
+        while (pos + 8 <= body) {
+            uint32_t ext_len = getBE32(data + pos + 4);
+            if (pos + 8 + ext_len > body) {
+                throw runtime_error("Index file is truncated");
+            }
+            if (memcmp(data + pos, CACHE_TREE_SIGNATURE, 4) == 0) {
+                parseCacheTree(data + pos + 8, ext_len);
+            } else if (memcmp(data + pos, FSMONITOR_SIGNATURE, 4) == 0) {
+                parseFsmonitor(data + pos + 8, ext_len);
+            }
+            pos += 8 + ext_len;
+        }
+    }
+
+    void parseFsmonitor(const unsigned char* data, size_t size) {
+        vector<string> fields;
+        for (size_t pos = 0; pos < size;) {
+            const void* nul = memchr(data + pos, '\0', size - pos);
+            if (!nul) return;
+            size_t end = static_cast<const unsigned char*>(nul) - data;
+            fields.emplace_back(reinterpret_cast<const char*>(data + pos), end - pos);
+            pos = end + 1;
+        }
+        if (fields.empty()) return;
+        fsmonitor_token = move(fields[0]);
+        fsmonitor_dirs.assign(make_move_iterator(fields.begin() + 1), make_move_iterator(fields.end()));
+    }
+
+    void parseCacheTree(const unsigned char* data, size_t size) {
+        size_t pos = 0;
+        while (pos < size) {
+            const void* nul = memchr(data + pos, '\0', size - pos);
+            if (!nul) break;
+            size_t path_end = static_cast<const unsigned char*>(nul) - data;
+            if (path_end + 1 + 8 + SHA_DIGEST_LENGTH > size) break;
+
+            string path(reinterpret_cast<const char*>(data + pos), path_end - pos);
+            const unsigned char* p = data + path_end + 1;
+            CacheTreeEntry entry;
+            entry.entry_count = getBE32(p);
+            entry.subtree_count = getBE32(p + 4);
+            memcpy(entry.sha1, p + 8, SHA_DIGEST_LENGTH);
+            cache_tree[path] = entry;
+            pos = path_end + 1 + 8 + SHA_DIGEST_LENGTH;
+        }
+    }
+
+    // Drops the cached trees of every directory containing `path`, and of
+    // `path` itself and everything below it when it is a directory
+    void invalidateCacheTree(const string& path) {
+        string prefix = path + "/";
+        for (auto it = cache_tree.lower_bound(prefix);
+             it != cache_tree.end() && it->first.rfind(prefix, 0) == 0;) {
+            it = cache_tree.erase(it);
+        }
+        cache_tree.erase(path);
+        for (size_t slash = path.rfind('/'); slash != string::npos && slash > 0;
+             slash = path.rfind('/', slash - 1)) {
+            cache_tree.erase(path.substr(0, slash));
+        }
+        cache_tree.erase("");
+    }
+
+    void writeIndex() {
+        Trace::Span span("writeIndex");
+        flushObjects();
+
+        string out;
+        out.append(INDEX_SIGNATURE, 4);
+        putBE32(out, INDEX_VERSION);
+        putBE32(out, index.size());
+
+        for (const auto& entry : index) {
+            size_t start = out.size();
+            putBE64(out, entry.mtime_ns);
+            putBE64(out, entry.ctime_ns);
+            putBE64(out, entry.size);
+            putBE64(out, entry.ino);
+            putBE64(out, entry.dev);
+            putBE32(out, entry.mode);
+            out.append(reinterpret_cast<const char*>(entry.sha1), SHA_DIGEST_LENGTH);
+            putBE16(out, entry.path.size());
+            out += entry.path;
+            out.append((8 - (out.size() - start) % 8) % 8, '\0');
+        }
+
+        if (!cache_tree.empty()) {
+            string ext;
+            for (const auto& [path, entry] : cache_tree) {
+                ext += path;
+                ext.push_back('\0');
+                putBE32(ext, entry.entry_count);
+                putBE32(ext, entry.subtree_count);
+                ext.append(reinterpret_cast<const char*>(entry.sha1), SHA_DIGEST_LENGTH);
+            }
+            out.append(CACHE_TREE_SIGNATURE, 4);
+            putBE32(out, ext.size());
+            out += ext;
+        }
+
+        if (!fsmonitor_token.empty()) {
+            string ext = fsmonitor_token;
+            ext.push_back('\0');
+            for (const auto& dir : fsmonitor_dirs) {
+                ext += dir;
+                ext.push_back('\0');
+            }
+            out.append(FSMONITOR_SIGNATURE, 4);
+            putBE32(out, ext.size());
+            out += ext;
+        }
+
+        unsigned char checksum[SHA_DIGEST_LENGTH];
+        Hasher::hash(out.data(), out.size(), checksum);
+        out.append(reinterpret_cast<const char*>(checksum), SHA_DIGEST_LENGTH);
+
+        // Write to a lock file and rename so readers never see a partial index
+        string lock_path = INDEX_FILE + ".lock";
+        {
+            ofstream index_file(lock_path, ios::binary | ios::trunc);
+            index_file.write(out.data(), out.size());
+            if (!index_file) {
+                throw runtime_error("Failed to write index");
+            }
+        }
+        fs::rename(lock_path, INDEX_FILE);
+    }
+
+    const IndexEntry* findIndexEntry(const string& path) const {
+        auto it = lower_bound(index.begin(), index.end(), path,
+                              [](const IndexEntry& e, const string& p) { return e.path < p; });
+        if (it == index.end() || it->path != path) return nullptr;
+        return &*it;
+    }
+
+    void stageEntry(IndexEntry entry) {
+        invalidateCacheTree(entry.path);
+        auto it = lower_bound(index.begin(), index.end(), entry.path,
+                              [](const IndexEntry& e, const string& p) { return e.path < p; });
+        if (it != index.end() && it->path == entry.path) {
+            *it = move(entry);
+        } else {
+            index.insert(it, move(entry));
+        }
+    }
+
+    bool statMatches(const IndexEntry& entry, const struct stat& st) const {
+        return entry.mtime_ns == toNs(st.st_mtim) &&
+               entry.ctime_ns == toNs(st.st_ctim) &&
+               entry.size == uint64_t(st.st_size) &&
+               entry.ino == uint64_t(st.st_ino) &&
+               entry.dev == uint64_t(st.st_dev) &&
+               entry.mode == uint32_t(st.st_mode) &&
+               entry.mtime_ns < index_mtime_ns;
+    }
+
+    static struct stat fromStatx(const struct statx& stx) {
+        struct stat st{};
+        st.st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        st.st_ino = stx.stx_ino;
+        st.st_mode = stx.stx_mode;
+        st.st_size = stx.stx_size;
+        st.st_mtim = {stx.stx_mtime.tv_sec, stx.stx_mtime.tv_nsec};
+        st.st_ctim = {stx.stx_ctime.tv_sec, stx.stx_ctime.tv_nsec};
+        return st;
+    }
+
+    static IndexEntry makeIndexEntry(const string& path, const struct stat& st, const string& sha) {
+        IndexEntry entry;
+        entry.path = path;
+        entry.mtime_ns = toNs(st.st_mtim);
+        entry.ctime_ns = toNs(st.st_ctim);
+        entry.size = st.st_size;
+        entry.ino = st.st_ino;
+        entry.dev = st.st_dev;
+        entry.mode = st.st_mode;
+        fromHex(sha, entry.sha1);
+        return entry;
+    }
+
+    size_t workerCount() const {
+        if (jobs > 0) return jobs;
+        return max(1u, thread::hardware_concurrency());
+    }
+
+    // Files per pool task when hashing: most files are small, so one task
+    // per file would spend as long queueing as hashing, while a worker
+    // running a batch reuses its warm hash context and buffers back to back
+    static constexpr size_t HASH_BATCH = 16;
+
+    struct RefreshItem {
+        const string* path;
+        IndexEntry* entry;
+        bool* unchanged;
+    };
+
+    // Index entries for one HASH_BATCH of working tree files. The cached SHA
+    // is reused when the stat data is unchanged; otherwise the file is
+    // hashed and written. The I/O is batched: a statx round for every file,
+    // then open, read and close rounds for the small files that changed.
+    // Chunked and large files are streamed by hashObject().
+    void refreshBatch(const vector<RefreshItem>& items) {
+        vector<struct statx> stx(items.size());
+        IoBatch stats(use_io_uring);
+        for (size_t i = 0; i < items.size(); i++) {
+            stats.statx(*items[i].path, &stx[i]);
+        }
+        stats.run();
+        Trace::count(Trace::SYS_STAT, items.size());
+
+        vector<size_t> small;
+        vector<struct stat> st(items.size());
+        for (size_t i = 0; i < items.size(); i++) {
+            const RefreshItem& item = items[i];
+            if (stats.result(i) < 0) {
+                throw runtime_error("File not found: " + *item.path);
+            }
+            st[i] = fromStatx(stx[i]);
+            const IndexEntry* cached = findIndexEntry(*item.path);
+            if (cached && statMatches(*cached, st[i])) {
+                Trace::count(Trace::STAT_CACHE_HITS);
+                *item.unchanged = true;
+                *item.entry = *cached;
+                continue;
+            }
+            Trace::count(Trace::STAT_CACHE_MISSES);
+
+            uint64_t size = st[i].st_size;
+            if (S_ISREG(st[i].st_mode) && size <= SMALL_BLOB && !(chunk_threshold && size >= chunk_threshold)) {
+                small.push_back(i);
+            } else {
+                bool probe = cached && cached->size == size;
+                *item.entry = makeIndexEntry(*item.path, st[i], hashObject(*item.path, true, probe));
+            }
+        }
+        if (small.empty()) return;
+
+        IoBatch opens(use_io_uring);
+        for (size_t i : small) {
+            opens.open(*items[i].path, O_RDONLY);
+        }
+        opens.run();
+        Trace::count(Trace::SYS_OPEN, small.size());
+
+        vector<string> contents(small.size());
+        IoBatch reads(use_io_uring);
+        IoBatch closes(use_io_uring);
+        for (size_t k = 0; k < small.size(); k++) {
+            int fd = opens.result(k);
+            if (fd < 0) continue;
+            // One byte past the stat size reveals a file that grew since
+            contents[k].resize(st[small[k]].st_size + 1);
+            reads.read(fd, contents[k].data(), contents[k].size());
+            closes.close(fd);
+        }
+        reads.run();
+        closes.run();
+
+        size_t read_index = 0;
+        for (size_t k = 0; k < small.size(); k++) {
+            const RefreshItem& item = items[small[k]];
+            if (opens.result(k) < 0) {
+                throw runtime_error("File not found: " + *item.path);
+            }
+            long got = reads.result(read_index++);
+            string sha;
+            if (got == long(contents[k].size()) - 1) {
+                contents[k].pop_back();
+                sha = writeObject("blob", contents[k]);
+            } else {
+                // Changed under us or a short read: take the streaming path
+                sha = hashObject(*item.path, true);
+            }
+            *item.entry = makeIndexEntry(*item.path, st[small[k]], sha);
+        }
+    }
+
+    // Hashes (and writes) every path on the thread pool, trusting the stat
+    // cache where possible. Results are returned in input order.
+    vector<IndexEntry> refreshEntries(const vector<string>& paths, bool* all_unchanged = nullptr) {
+        vector<IndexEntry> entries(paths.size());
+        unique_ptr<bool[]> unchanged(new bool[paths.size()]());
+        size_t batches = (paths.size() + HASH_BATCH - 1) / HASH_BATCH;
+        ThreadPool pool(min(workerCount(), max<size_t>(batches, 1)));
+        for (size_t start = 0; start < paths.size(); start += HASH_BATCH) {
+            pool.submit([&, start] {
+                size_t end = min(start + HASH_BATCH, paths.size());
+                vector<RefreshItem> items;
+                for (size_t i = start; i < end; i++) {
+                    items.push_back({&paths[i], &entries[i], &unchanged[i]});
+                }
+                refreshBatch(items);
+            });
+        }
+        pool.wait();
+        if (all_unchanged) {
+            *all_unchanged = all_of(unchanged.get(), unchanged.get() + paths.size(),
+                                    [](bool u) { return u; });
+        }
+        return entries;
+    }
+
+    void enumerateSnapshot(Snapshot& snap) {
+        Trace::Span span("walk");
+        snap.dirs.push_back({"", -1, {}, ""});
+
+        // Breadth-first; dirs grows while we walk it
+        for (size_t d = 0; d < snap.dirs.size(); d++) {
+            string dir = snap.dirs[d].path;
+            vector<SnapshotChild> children;
+
+            for (const auto& entry : fs::directory_iterator(dir.empty() ? "." : dir)) {
+                string name = entry.path().filename().string();
+                if (name == GIT_DIR) continue;
+                string path = dir.empty() ? name : dir + "/" + name;
+
+                if (fs::is_directory(entry)) {
+                    children.push_back({name, true, snap.dirs.size()});
+                    snap.dirs.push_back({path, long(d), {}, ""});
+                } else {
+                    children.push_back({name, false, snap.files.size()});
+                    snap.files.push_back({path, d, {}});
+                }
+            }
+
+            sort(children.begin(), children.end(), [](const SnapshotChild& a, const SnapshotChild& b) {
+                return treeOrder(a.name, a.is_dir, b.name, b.is_dir);
+            });
+            snap.dirs[d].children = move(children);
+        }
+    }
+
+    // Asks the fsmonitor daemon what changed since the index token. Any
+    // failure (daemon gone, slow, unknown token) means a full scan.
+    FsChanges queryFsmonitor() {
+        FsChanges changes;
+        if (!fsmonitor_enabled) return changes;
+        Trace::Span span("fsmonitor");
+
+        string reply = FsMonitor::request(FSMONITOR_SOCKET, "changes " + fsmonitor_token + "\n");
+        size_t eol = reply.find('\n');
+        if (eol == string::npos) return changes;
+        changes.token = reply.substr(0, eol);
+        if (reply.compare(eol + 1, string::npos, "*\n") == 0) return changes;
+
+        for (size_t pos = eol + 1; pos < reply.size();) {
+            size_t nul = reply.find('\0', pos);
+            if (nul == string::npos) return changes;  // truncated reply
+            changes.paths.push_back(reply.substr(pos, nul - pos));
+            pos = nul + 1;
+        }
+        changes.full = false;
+        return changes;
+    }
+
+    // The working tree as the index and the daemon describe it: unreported
+    // files map to their index entry, reported ones (and everything in a
+    // reported directory, which is rescanned) to null, meaning "stat it"
+    void changedTree(const FsChanges& changes, map<string, const IndexEntry*>& files, set<string>& dirs) {
+        Trace::Span span("changedTree");
+        for (const auto& entry : index) files.emplace(entry.path, &entry);
+        dirs.insert(fsmonitor_dirs.begin(), fsmonitor_dirs.end());
+
+        // Everything below `path`: keys in ["path/", "path0"), '0' being '/' + 1
+        auto eraseBelow = [&](const string& path) {
+            files.erase(files.lower_bound(path + "/"), files.lower_bound(path + "0"));
+            dirs.erase(dirs.lower_bound(path + "/"), dirs.lower_bound(path + "0"));
+        };
+
+        vector<string> paths = changes.paths;
+        sort(paths.begin(), paths.end());  // parents before children
+        for (const auto& path : paths) {
+            struct stat st;
+            Trace::count(Trace::SYS_STAT);
+            if (stat(path.c_str(), &st) != 0) {
+                files.erase(path);
+                dirs.erase(path);
+                eraseBelow(path);
+            } else if (S_ISDIR(st.st_mode)) {
+                files.erase(path);
+                eraseBelow(path);
+                dirs.insert(path);
+                for (fs::recursive_directory_iterator it(path), end; it != end; ++it) {
+                    string child = it->path().generic_string();
+                    if (fs::is_directory(it->path())) dirs.insert(child);
+                    else files[child] = nullptr;
+                }
+            } else {
+                dirs.erase(path);
+                eraseBelow(path);
+                files[path] = nullptr;
+            }
+        }
+    }
+
+    // Snapshot layout built from changedTree() instead of a directory walk.
+    // Unreported files keep their index entry and are never stat'ed. False
+    // if the pieces do not fit together (a file outside any known
+    // directory), in which case the caller scans instead.
+    bool enumerateChanged(Snapshot& snap, const map<string, const IndexEntry*>& files, const set<string>& dirs) {
+        snap.dirs.push_back({"", -1, {}, ""});
+        unordered_map<string, size_t> dir_index{{"", 0}};
+        auto parentOf = [&](const string& path, size_t& parent) {
+            size_t slash = path.rfind('/');
+            auto it = dir_index.find(slash == string::npos ? "" : path.substr(0, slash));
+            if (it == dir_index.end()) return false;
+            parent = it->second;
+            return true;
+        };
+
+        for (const auto& dir : dirs) {  // sorted, so parents come first
+            size_t parent;
+            if (!parentOf(dir, parent)) return false;
+            snap.dirs[parent].children.push_back({dir.substr(dir.rfind('/') + 1), true, snap.dirs.size()});
+            dir_index[dir] = snap.dirs.size();
+            snap.dirs.push_back({dir, long(parent), {}, ""});
+        }
+        for (const auto& [path, entry] : files) {
+            size_t parent;
+            if (!parentOf(path, parent)) return false;
+            snap.dirs[parent].children.push_back({path.substr(path.rfind('/') + 1), false, snap.files.size()});
+            snap.files.push_back({path, parent, {}});
+            if (entry) {
+                snap.files.back().entry = *entry;
+                snap.files.back().unchanged = true;
+            }
+        }
+
+        for (auto& dir : snap.dirs) {
+            sort(dir.children.begin(), dir.children.end(), [](const SnapshotChild& a, const SnapshotChild& b) {
+                return treeOrder(a.name, a.is_dir, b.name, b.is_dir);
+            });
+        }
+        return true;
+    }
+
+    // True when the cache-tree still describes this directory: every file in
+    // it hit the stat cache, every subdirectory was reused and the counts
+    // agree, so no entry was added or removed below it
+    bool reuseCachedTree(SnapshotDir& dir, const Snapshot& snap) const {
+        auto cached = cache_tree.find(dir.path);
+        if (cached == cache_tree.end() ||
+            cached->second.entry_count != dir.entry_count ||
+            cached->second.subtree_count != dir.subtree_count) {
+            return false;
+        }
+        for (const auto& child : dir.children) {
+            bool unchanged = child.is_dir ? snap.dirs[child.index].unchanged
+                                          : snap.files[child.index].unchanged;
+            if (!unchanged) return false;
+        }
+        dir.sha = toHex(cached->second.sha1);
+        return true;
+    }
+
+    // Git's tree order: names compare bytewise, with a directory sorting as
+    // if its name ended in '/'
+    static bool treeOrder(string_view a, bool a_dir, string_view b, bool b_dir) {
+        size_t common = min(a.size(), b.size());
+        int cmp = a.substr(0, common).compare(b.substr(0, common));
+        if (cmp != 0) return cmp < 0;
+        unsigned char ca = a.size() > common ? a[common] : (a_dir ? '/' : '\0');
+        unsigned char cb = b.size() > common ? b[common] : (b_dir ? '/' : '\0');
+        return ca < cb;
+    }
+
+    void writeSnapshotTree(Snapshot& snap, size_t d) {
+        SnapshotDir& dir = snap.dirs[d];
+        for (const auto& child : dir.children) {
+            if (child.is_dir) {
+                dir.entry_count += snap.dirs[child.index].entry_count;
+                dir.subtree_count++;
+            } else {
+                dir.entry_count++;
+            }
+        }
+        if (reuseCachedTree(dir, snap)) {
+            dir.unchanged = true;
+            return;
+        }
+
+        // Binary entries: "<mode> <name>\0" followed by the raw SHA-1
+        string tree_content;
+        for (const auto& child : dir.children) {
+            unsigned char raw[SHA_DIGEST_LENGTH];
+            const unsigned char* sha1 = raw;
+            if (child.is_dir) {
+                tree_content += "40000 ";
+                fromHex(snap.dirs[child.index].sha, raw);
+            } else {
+                tree_content += "100644 ";
+                sha1 = snap.files[child.index].entry.sha1;
+            }
+            tree_content += child.name;
+            tree_content.push_back('\0');
+            tree_content.append(reinterpret_cast<const char*>(sha1), SHA_DIGEST_LENGTH);
+        }
+
+        dir.sha = writeObject("tree", tree_content);
+    }
+
+    void buildSnapshot(Snapshot& snap) {
+        Trace::Span span("buildSnapshot");
+        // Outstanding children per directory; the thread that finishes the
+        // last child assembles the tree, then reports to the parent
+        unique_ptr<atomic<size_t>[]> pending(new atomic<size_t>[snap.dirs.size()]);
+        for (size_t d = 0; d < snap.dirs.size(); d++) {
+            pending[d] = snap.dirs[d].children.size();
+        }
+
+        function<void(size_t)> finishDir = [&](size_t d) {
+            writeSnapshotTree(snap, d);
+            long parent = snap.dirs[d].parent;
+            if (parent >= 0 && --pending[parent] == 0) {
+                finishDir(parent);
+            }
+        };
+
+        ThreadPool pool(workerCount());
+        for (size_t start = 0; start < snap.files.size(); start += HASH_BATCH) {
+            pool.submit([&, start] {
+                size_t end = min(start + HASH_BATCH, snap.files.size());
+                vector<RefreshItem> items;
+                for (size_t i = start; i < end; i++) {
+                    SnapshotFile& file = snap.files[i];
+                    if (!file.unchanged) items.push_back({&file.path, &file.entry, &file.unchanged});
+                }
+                refreshBatch(items);
+                for (size_t i = start; i < end; i++) {
+                    SnapshotFile& file = snap.files[i];
+                    if (--pending[file.dir] == 0) {
+                        finishDir(file.dir);
+                    }
+                }
+            });
+        }
+        for (size_t d = 0; d < snap.dirs.size(); d++) {
+            if (snap.dirs[d].children.empty()) {
+                pool.submit([&, d] { finishDir(d); });
+            }
+        }
+        pool.wait();
+    }
+
+public:
+    MiniVCS() {
+        loadConfig();
+        object_cache.setBudget(configSize("core.objectcachesize", DEFAULT_OBJECT_CACHE_SIZE));
+        delta_base_cache.setBudget(configSize("core.deltabasecachelimit", DEFAULT_DELTA_BASE_CACHE));
+
+        auto fsync_it = config.find("core.fsyncobjects");
+        if (fsync_it != config.end()) {
+            string mode = lowercase(fsync_it->second);
+            if (mode == "none" || mode == "false") fsync_mode = FsyncMode::NONE;
+            else if (mode == "object" || mode == "true") fsync_mode = FsyncMode::OBJECT;
+            else if (mode == "batch") fsync_mode = FsyncMode::BATCH;
+            else throw runtime_error("Bad value for core.fsyncObjects: " + fsync_it->second);
+        }
+
+        // Object names, the index, packs and the commit-graph are laid out
+        // for 20-byte SHA-1 names; the hash backend can already produce
+        // SHA-256, but a repository that asks for it cannot be read yet
+        auto format_it = config.find("extensions.objectformat");
+        if (format_it != config.end() && format_it->second != "sha1") {
+            throw runtime_error("Unsupported extensions.objectFormat: " + format_it->second +
+                                " (only sha1 repositories are supported)");
+        }
+
+        compression.blob = configLevel("compression.blob", compression.blob);
+        compression.tree = configLevel("compression.tree", compression.tree);
+        compression.commit = configLevel("compression.commit", compression.commit);
+        compression.pack = configLevel("compression.pack", compression.pack);
+        auto store_it = config.find("compression.storeincompressible");
+        if (store_it != config.end()) {
+            string value = lowercase(store_it->second);
+            if (value == "true") compression.store_incompressible = true;
+            else if (value == "false") compression.store_incompressible = false;
+            else throw runtime_error("Bad value for compression.storeIncompressible: " + store_it->second);
+        }
+
+        auto fsmonitor_it = config.find("core.fsmonitor");
+        fsmonitor_enabled = fsmonitor_it != config.end() && lowercase(fsmonitor_it->second) == "true";
+
+        auto verify_it = config.find("core.verifyobjects");
+        if (verify_it != config.end()) {
+            string value = lowercase(verify_it->second);
+            if (value == "true") verify_objects = true;
+            else if (value != "false") throw runtime_error("Bad value for core.verifyObjects: " + verify_it->second);
+        }
+
+        auto io_it = config.find("core.iobackend");
+        if (io_it != config.end()) {
+            string backend = lowercase(io_it->second);
+            if (backend == "threads") use_io_uring = false;
+            else if (backend == "io_uring" && !IoRing::forThread()) {
+                throw runtime_error("core.ioBackend is io_uring but the kernel does not support it");
+            } else if (backend != "auto" && backend != "io_uring") {
+                throw runtime_error("Bad value for core.ioBackend: " + io_it->second);
+            }
+        }
+
+        chunk_threshold = configSize("chunking.threshold", 0);
+        chunk_min = configSize("chunking.minsize", DEFAULT_CHUNK_MIN);
+        chunk_avg = configSize("chunking.avgsize", DEFAULT_CHUNK_AVG);
+        chunk_max = configSize("chunking.maxsize", DEFAULT_CHUNK_MAX);
+        if (chunk_avg < 64 || (chunk_avg & (chunk_avg - 1)) || chunk_min >= chunk_avg ||
+            chunk_max <= chunk_avg) {
+            throw runtime_error("chunking sizes need minSize < avgSize < maxSize, avgSize a power of two");
+        }
+    }
+
+    ~MiniVCS() {
+        // Objects written by commands that update no index or ref
+        try {
+            flushObjects();
+        } catch (const exception& e) {
+            cerr << "Error: " << e.what() << endl;
+        }
+    }
+
+    ObjectCache<>::Stats objectCacheStats() const {
+        return object_cache.stats();
+    }
+
+    // Serves fsmonitor queries for this working tree. With `detach`, forks
+    // the daemon into the background and returns once it is listening.
+    void runFsmonitor(bool detach) {
+        if (!fs::exists(GIT_DIR)) {
+            throw runtime_error("Not a mygit repository");
+        }
+        auto monitor = make_unique<FsMonitor>(FSMONITOR_SOCKET, GIT_DIR);
+        monitor->listen();
+        if (!detach) {
+            monitor->run();
+            return;
+        }
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            throw runtime_error("Cannot start fsmonitor: fork failed");
+        }
+        if (pid > 0) {
+            monitor->disown();
+            return;
+        }
+
+        setsid();
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0) {
+            dup2(null_fd, 0);
+            dup2(null_fd, 1);
+            dup2(null_fd, 2);
+            if (null_fd > 2) close(null_fd);
+        }
+        int status = 0;
+        try {
+            monitor->run();
+        } catch (...) {
+            status = 1;
+        }
+        monitor.reset();
+        _exit(status);
+    }
+
+    // Reply to a daemon request ("" when no daemon answers)
+    string fsmonitorRequest(const string& request) {
+        return FsMonitor::request(FSMONITOR_SOCKET, request + "\n");
+    }
+
+    void init() {
+        if (fs::exists(GIT_DIR)) {
+            throw runtime_error("Repository already exists");
+        }
+
+        fs::create_directories(GIT_DIR + "/objects");
+        fs::create_directories(GIT_DIR + "/refs/heads");
+        
+        ofstream head(HEAD_FILE);
+        head << "ref: refs/heads/master";
+    }
+
+    // `probe` hints that the content is probably already stored (e.g. only
+    // its stat data changed): a large file is then hashed once before being
+    // compressed, instead of compressing it speculatively.
+    string hashObject(const string& path, bool write = false, bool probe = false) {
+        Trace::Span span("hashObject");
+        Trace::count(Trace::SYS_OPEN);
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("File not found: " + path);
+        }
+
+        try {
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                throw runtime_error("Cannot stat " + path);
+            }
+
+            if (chunk_threshold && uint64_t(st.st_size) >= chunk_threshold) {
+                string sha = chunkFile(fd, path, write);
+                close(fd);
+                fd = -1;
+                return sha;
+            }
+
+            if (write && uint64_t(st.st_size) <= SMALL_BLOB) {
+                string content(st.st_size, '\0');
+                size_t got = 0;
+                while (got < content.size()) {
+                    ssize_t n = read(fd, content.data() + got, content.size() - got);
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n <= 0) throw runtime_error("Failed to read " + path);
+                    got += n;
+                }
+                close(fd);
+                fd = -1;
+                return writeObject("blob", content);
+            }
+
+            if (write && probe) {
+                string sha = streamBlob(fd, path, st.st_size, false);
+                if (hasObject(sha)) {
+                    close(fd);
+                    fd = -1;
+                    return sha;
+                }
+                if (lseek(fd, 0, SEEK_SET) != 0) {
+                    throw runtime_error("Failed to read " + path);
+                }
+            }
+
+            string sha = streamBlob(fd, path, st.st_size, write);
+            close(fd);
+            fd = -1;
+            return sha;
+        } catch (...) {
+            if (fd >= 0) close(fd);
+            throw;
+        }
+    }
+
+    // Feeds an open file through an ObjectWriter in fixed-size chunks, so
+    // memory stays bounded for huge files
+    string streamBlob(int fd, const string& path, uint64_t size, bool write) {
+        ObjectWriter writer(*this, "blob", size, write);
+        vector<char> buffer(65536);
+        ssize_t n;
+        while ((n = read(fd, buffer.data(), buffer.size())) != 0) {
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error("Failed to read " + path);
+            }
+            writer.update(buffer.data(), n);
+        }
+        return writer.finish();
+    }
+
+    void setJobs(size_t n) {
+        jobs = n;
+    }
+
+    string writeTree() {
+        Trace::Span span("writeTree");
+        loadIndex();
+
+        FsChanges changes = queryFsmonitor();
+        Snapshot snap;
+        if (!changes.full) {
+            map<string, const IndexEntry*> files;
+            set<string> dirs;
+            changedTree(changes, files, dirs);
+            if (!enumerateChanged(snap, files, dirs)) {
+                snap = Snapshot();
+                changes.full = true;
+            }
+        }
+        if (changes.full) enumerateSnapshot(snap);
+        buildSnapshot(snap);
+
+        // Keep the refreshed stat data so the next snapshot only re-hashes
+        // files that changed
+        vector<IndexEntry> seen;
+        seen.reserve(snap.files.size());
+        for (auto& file : snap.files) {
+            seen.push_back(move(file.entry));
+        }
+        sort(seen.begin(), seen.end(),
+             [](const IndexEntry& a, const IndexEntry& b) { return a.path < b.path; });
+        index = move(seen);
+
+        // Every directory of the snapshot now has a known tree
+        cache_tree.clear();
+        fsmonitor_dirs.clear();
+        for (const auto& dir : snap.dirs) {
+            CacheTreeEntry entry;
+            entry.entry_count = dir.entry_count;
+            entry.subtree_count = dir.subtree_count;
+            fromHex(dir.sha, entry.sha1);
+            cache_tree[dir.path] = entry;
+            if (!dir.path.empty()) fsmonitor_dirs.push_back(dir.path);
+        }
+        sort(fsmonitor_dirs.begin(), fsmonitor_dirs.end());
+        fsmonitor_token = changes.token;
+        writeIndex();
+        return snap.dirs[0].sha;
+    }
+
+    void add(const vector<string>& paths) {
+        Trace::Span span("add");
+        loadIndex();
+
+        // With fsmonitor, directories are listed from the index plus the
+        // reported changes instead of being walked
+        FsChanges changes;
+        map<string, const IndexEntry*> tree_files;
+        set<string> tree_dirs;
+        bool whole_tree = false;
+        vector<string> walked_dirs;
+
+        // Collect everything first so hashing can run in parallel
+        vector<string> files;
+        vector<string> replaced_prefixes;
+        for (const auto& arg : paths) {
+            string path = normalizePath(arg);
+            if (!fs::exists(path.empty() ? "." : path)) {
+                throw runtime_error("File not found: " + arg);
+            }
+
+            if (!path.empty() && !fs::is_directory(path)) {
+                files.push_back(path);
+                continue;
+            }
+
+            // Add every file below the directory, dropping entries for files
+            // that no longer exist there
+            string prefix = path.empty() ? "" : path + "/";
+            replaced_prefixes.push_back(prefix);
+            if (path.empty()) whole_tree = true;
+
+            if (replaced_prefixes.size() == 1) {
+                changes = queryFsmonitor();
+                if (!changes.full) changedTree(changes, tree_files, tree_dirs);
+            }
+            if (!changes.full) {
+                for (auto it = tree_files.lower_bound(prefix);
+                     it != tree_files.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+                    if (!it->second) files.push_back(it->first);
+                }
+                continue;
+            }
+
+            fs::recursive_directory_iterator it(path.empty() ? "." : path), end;
+            for (; it != end; ++it) {
+                if (it->path().filename().string() == GIT_DIR) {
+                    it.disable_recursion_pending();
+                    continue;
+                }
+                if (fs::is_directory(it->path())) {
+                    if (path.empty()) walked_dirs.push_back(normalizePath(it->path().string()));
+                    continue;
+                }
+                files.push_back(normalizePath(it->path().string()));
+            }
+        }
+
+        bool unchanged;
+        vector<IndexEntry> found = refreshEntries(files, &unchanged);
+        size_t before = index.size();
+
+        for (const auto& prefix : replaced_prefixes) {
+            if (!changes.full) {
+                // Entries fsmonitor did not report stay as they are; the
+                // rest are re-staged from `found` or no longer exist
+                auto stale = [&](const IndexEntry& e) {
+                    if (e.path.compare(0, prefix.size(), prefix) != 0) return false;
+                    auto it = tree_files.find(e.path);
+                    return it == tree_files.end() || !it->second;
+                };
+                for (const auto& entry : index) {
+                    if (stale(entry)) invalidateCacheTree(entry.path);
+                }
+                index.erase(remove_if(index.begin(), index.end(), stale), index.end());
+                continue;
+            }
+            if (prefix.empty()) {
+                cache_tree.clear();
+            } else {
+                invalidateCacheTree(prefix.substr(0, prefix.size() - 1));
+            }
+            index.erase(remove_if(index.begin(), index.end(),
+                                  [&](const IndexEntry& e) { return e.path.rfind(prefix, 0) == 0; }),
+                        index.end());
+        }
+        for (auto& entry : found) {
+            stageEntry(move(entry));
+        }
+
+        // The whole tree was just refreshed, so the index now matches the
+        // daemon's state at the new token
+        bool new_token = false;
+        if (whole_tree && changes.token != fsmonitor_token) {
+            fsmonitor_token = changes.token;
+            if (changes.full) {
+                fsmonitor_dirs = move(walked_dirs);
+            } else {
+                fsmonitor_dirs.assign(tree_dirs.begin(), tree_dirs.end());
+            }
+            sort(fsmonitor_dirs.begin(), fsmonitor_dirs.end());
+            new_token = true;
+        }
+
+        // Every file hit the stat cache and no stale entry was dropped: the
+        // index on disk is still exact, so leave it untouched
+        if (unchanged && index.size() == before && !new_token) return;
+
+        writeIndex();
+    }
+
+    string commit(const string& message) {
+        Trace::Span span("commit");
+        string tree_sha = writeTree();
+        
+        // The parent is whatever HEAD points at, a branch or (after a
+        // checkout) a bare commit
+        string parent_sha = headCommit();
+        string head_content;
+        {
+            ifstream head(HEAD_FILE);
+            getline(head, head_content);
+        }
+        
+        // Get current timestamp
+        time_t current_time = time(nullptr);
+        
+        // Create commit object with timestamp
+        stringstream commit_content;
+        commit_content << "tree " << tree_sha << "\n";
+        if (!parent_sha.empty()) {
+            commit_content << "parent " << parent_sha << "\n";
+        }
+        commit_content << "author User <user@example.com> " << current_time << "\n";
+        commit_content << "committer User <user@example.com> " << current_time << "\n";
+        commit_content << "timestamp " << current_time << "\n\n";  // Add explicit timestamp
+        commit_content << message;
+        
+        string content = commit_content.str();
+        string commit_sha = writeObject("commit", content);
+        
+        flushObjects();
+
+        // Advance the branch HEAD refers to, or a detached HEAD itself, so
+        // HEAD's tree keeps describing the working tree for checkout
+        string ref_path = head_content.substr(0, 5) == "ref: " ? GIT_DIR + "/" + head_content.substr(5) : HEAD_FILE;
+        fs::create_directories(fs::path(ref_path).parent_path());  // Ensure directory exists
+        {
+            ofstream ref_file(ref_path);
+            ref_file << commit_sha;
+        }
+        
+        appendCommitGraph(commit_sha, CommitView(content));
+        appendBloomFilter(commit_sha, parent_sha.empty() ? "" : commitTree(parent_sha), tree_sha);
+        
+        // Set proper permissions for the working directory
+        fs::permissions(".", fs::perms::owner_all | fs::perms::group_read | fs::perms::others_read,
+                    fs::perm_options::add);
+        
+        return commit_sha;
+    }
+
+    // Mode and SHA of the entry at `path` in a tree, "" when absent
+    string treeEntryAt(string sha, string_view path) {
+        while (!path.empty()) {
+            size_t slash = path.find('/');
+            string_view name = path.substr(0, slash);
+            path = slash == string_view::npos ? string_view() : path.substr(slash + 1);
+            ObjectView tree = readObject(sha);
+            string found;
+            for (const auto& entry : TreeView(tree)) {
+                if (entry.name != name) continue;
+                if (path.empty()) return string(entry.mode) + " " + entry.hex();
+                if (entry.isTree()) found = entry.hex();
+                break;
+            }
+            if (found.empty()) return "";
+            sha = found;
+        }
+        return "";
+    }
+
+    // Whether a commit changed anything at or below one of `paths`. The
+    // commit's Bloom filter answers "no" for most commits without a tree
+    // being read; otherwise the entries at each path are compared.
+    bool touchesPaths(const ObjectId& commit, const string& tree, const string& parent_tree,
+                      const vector<string>& paths) {
+        const string_view* filter = bloomFilter(commit);
+        if (filter) {
+            bool maybe = any_of(paths.begin(), paths.end(),
+                                [&](const string& path) { return bloomMaybeContains(*filter, path); });
+            if (!maybe) {
+                Trace::count(Trace::BLOOM_NEGATIVES);
+                return false;
+            }
+            Trace::count(Trace::BLOOM_MAYBES);
+        }
+        for (const auto& path : paths) {
+            string entry = treeEntryAt(tree, path);
+            if (entry != (parent_tree.empty() ? "" : treeEntryAt(parent_tree, path))) return true;
+        }
+        if (filter) Trace::count(Trace::BLOOM_FALSE_POSITIVES);
+        return false;
+    }
+
+    // log limited to commits that changed something at or below `paths`
+    // (repository-relative files or directories)
+    void log(string start, vector<string> paths,
+             const function<bool(const string&, const CommitView&)>& visit) {
+        for (auto& path : paths) {
+            while (path.rfind("./", 0) == 0) path.erase(0, 2);
+            while (!path.empty() && path.back() == '/') path.pop_back();
+            if (path.empty() || path == ".") {
+                paths.clear();  // The whole tree
+                break;
+            }
+        }
+        if (paths.empty()) {
+            log(start, visit);
+            return;
+        }
+
+        Trace::Span span("log");
+        if (start.empty()) start = headCommit();
+        string current_sha = start;
+        while (!current_sha.empty()) {
+            ObjectId id;
+            if (!fromHex(current_sha, id.data())) break;
+
+            string tree, parent_sha;
+            uint32_t pos;
+            optional<ObjectView> commit;
+            if (graphPosition(current_sha, pos)) {
+                tree = toHex(graph_rows[pos].tree.data());
+                uint32_t parent = graph_rows[pos].parents[0];
+                if (parent != GRAPH_NONE) parent_sha = toHex(graph_rows[parent].sha.data());
+            } else {
+                commit = readObject(current_sha);
+                if (commit->type() != "commit") break;
+                CommitView parsed(*commit);
+                tree = string(parsed.tree());
+                parent_sha = string(parsed.parent());
+            }
+
+            if (touchesPaths(id, tree, parent_sha.empty() ? "" : commitTree(parent_sha), paths)) {
+                if (!commit) commit = readObject(current_sha);
+                if (!visit(current_sha, CommitView(*commit))) return;
+            }
+            current_sha = parent_sha;
+        }
+    }
+
+    // Runs of commits covered by the commit-graph are walked without
+    // reading any object; their commit objects are then inflated in parallel
+    // ahead of the visitor.
+    void log(string start, const function<bool(const string&, const CommitView&)>& visit) {
+        Trace::Span span("log");
+        if (start.empty()) start = headCommit();
+
+        string current_sha = start;
+        unique_ptr<ThreadPool> pool;
+        while (!current_sha.empty()) {
+            vector<uint32_t> run;
+            uint32_t pos;
+            string next_sha = current_sha;
+            while (!next_sha.empty() && run.size() < LOG_BATCH && graphPosition(next_sha, pos)) {
+                run.push_back(pos);
+                uint32_t parent = graph_rows[pos].parents[0];
+                next_sha = parent == GRAPH_NONE ? "" : toHex(graph_rows[parent].sha.data());
+            }
+
+            if (!run.empty()) {
+                if (!pool) pool = make_unique<ThreadPool>(workerCount());
+                vector<ObjectView> commits(run.size());
+                for (size_t i = 0; i < run.size(); i++) {
+                    pool->submit([&, i] { commits[i] = readObject(toHex(graph_rows[run[i]].sha.data())); });
+                }
+                pool->wait();
+
+                for (size_t i = 0; i < run.size(); i++) {
+                    if (!visit(toHex(graph_rows[run[i]].sha.data()), CommitView(commits[i]))) return;
+                }
+                current_sha = next_sha;
+                continue;
+            }
+
+            // Not in the graph: read the commit itself
+            ObjectView commit = readObject(current_sha);
+            if (commit.type() != "commit") break;
+
+            CommitView parsed(commit);
+            if (!visit(current_sha, parsed)) return;
+            current_sha = string(parsed.parent());
+        }
+    }
+
+    // Commits reachable from `start` (HEAD by default), newest first
+    void revList(string start, const function<bool(const string&)>& visit) {
+        Trace::Span span("revList");
+        if (start.empty()) start = headCommit();
+
+        string current_sha = start;
+        while (!current_sha.empty()) {
+            if (!visit(current_sha)) return;
+
+            uint32_t pos;
+            if (graphPosition(current_sha, pos)) {
+                uint32_t parent = graph_rows[pos].parents[0];
+                current_sha = parent == GRAPH_NONE ? "" : toHex(graph_rows[parent].sha.data());
+                continue;
+            }
+
+            ObjectView commit = readObject(current_sha);
+            if (commit.type() != "commit") {
+                throw runtime_error("Not a commit object: " + current_sha);
+            }
+            current_sha = string(CommitView(commit).parent());
+        }
+    }
+
+    Status status() {
+        Trace::Span span("status");
+        loadIndex();
+        Status result;
+
+        // Working tree vs index: stat every entry in parallel and hash only
+        // those whose stat data no longer matches
+        enum State : char { CLEAN, REFRESHED, MODIFIED, DELETED };
+        vector<State> states(index.size(), CLEAN);
+        vector<struct stat> stats(index.size());
+        constexpr size_t BATCH = 512;
+        {
+            ThreadPool pool(min(workerCount(), index.size() / BATCH + 1));
+            for (size_t start = 0; start < index.size(); start += BATCH) {
+                pool.submit([&, start] {
+                    for (size_t i = start; i < min(start + BATCH, index.size()); i++) {
+                        const IndexEntry& entry = index[i];
+                        struct stat& st = stats[i];
+                        Trace::count(Trace::SYS_STAT);
+                        if (stat(entry.path.c_str(), &st) != 0 || S_ISDIR(st.st_mode)) {
+                            states[i] = DELETED;
+                        } else if (statMatches(entry, st)) {
+                            Trace::count(Trace::STAT_CACHE_HITS);
+                        } else {
+                            Trace::count(Trace::STAT_CACHE_MISSES);
+                            unsigned char sha1[SHA_DIGEST_LENGTH];
+                            fromHex(hashObject(entry.path), sha1);
+                            bool same = memcmp(sha1, entry.sha1, SHA_DIGEST_LENGTH) == 0;
+                            states[i] = same ? REFRESHED : MODIFIED;
+                        }
+                    }
+                });
+            }
+            pool.wait();
+        }
+
+        bool refreshed = false;
+        for (size_t i = 0; i < index.size(); i++) {
+            if (states[i] == MODIFIED) {
+                result.unstaged.push_back({StatusEntry::MODIFIED, index[i].path});
+            } else if (states[i] == DELETED) {
+                result.unstaged.push_back({StatusEntry::DELETED, index[i].path});
+            } else if (states[i] == REFRESHED) {
+                // Same content: remember the new stat data so the next run
+                // does not hash it again
+                unsigned char sha1[SHA_DIGEST_LENGTH];
+                memcpy(sha1, index[i].sha1, SHA_DIGEST_LENGTH);
+                index[i] = makeIndexEntry(index[i].path, stats[i], toHex(sha1));
+                refreshed = true;
+            }
+        }
+
+        collectStaged(result.staged);
+        collectUntracked("", result.untracked);
+        if (refreshed) writeIndex();
+        return result;
+    }
+
+    void diff(const vector<string>& paths, const function<void(const FileDiff&)>& visit) {
+        Trace::Span span("diff");
+        vector<string> prefixes;
+        for (const auto& path : paths) prefixes.push_back(normalizePath(path));
+        auto selected = [&](const string& path) {
+            if (prefixes.empty()) return true;
+            for (const auto& prefix : prefixes) {
+                if (prefix.empty() || path == prefix || path.rfind(prefix + "/", 0) == 0) return true;
+            }
+            return false;
+        };
+
+        for (const auto& change : status().unstaged) {
+            if (!selected(change.path)) continue;
+
+            const IndexEntry* entry = findIndexEntry(change.path);
+            ObjectView old_blob = readObject(toHex(entry->sha1));
+
+            size_t new_size = 0;
+            const unsigned char* new_data = nullptr;
+            if (change.kind == StatusEntry::MODIFIED) {
+                struct stat st;
+                if (stat(change.path.c_str(), &st) == 0 && st.st_size > 0) {
+                    new_data = mapFile(change.path, new_size);
+                }
+            }
+
+            try {
+                string_view old_text = old_blob.content();
+                string_view new_text(reinterpret_cast<const char*>(new_data), new_size);
+                FileDiff file;
+                file.path = change.path;
+                file.kind = change.kind;
+                file.binary = old_blob.type() != "blob" || looksBinary(old_text) || looksBinary(new_text);
+                if (!file.binary) file.hunks = diffLines(old_text, new_text);
+                visit(file);
+            } catch (...) {
+                if (new_data) munmap(const_cast<unsigned char*>(new_data), new_size);
+                throw;
+            }
+            if (new_data) munmap(const_cast<unsigned char*>(new_data), new_size);
+        }
+    }
+
+    CheckoutStats checkout(const string& commit_sha) {
+        Trace::Span span("checkout");
+    CheckoutStats stats;
+    auto started = chrono::steady_clock::now();
+    string tree_sha = commitTree(commit_sha);
+    
+    // Get the name of the current executable
+    char buffer[1024];
+    ssize_t len = readlink("/proc/self/exe", buffer, sizeof(buffer)-1);
+    if (len != -1) {
+        buffer[len] = '\0';
+    }
+    string executable_path = buffer;
+    string executable_name = fs::path(executable_path).filename().string();
+    
+    loadIndex();
+    vector<CheckoutOp> ops;
+    
+    // Only touch what differs from the commit we are on. Without a readable
+    // HEAD commit, clear the working directory (except .mygit and the
+    // executable) and restore everything.
+    string head_tree;
+    try {
+        string head_sha = headCommit();
+        if (!head_sha.empty()) head_tree = commitTree(head_sha);
+    } catch (const exception&) {
+        head_tree.clear();
+    }
+    
+    if (!head_tree.empty()) {
+        diffTrees(head_tree, tree_sha, "", executable_name, ops);
+    } else {
+        for (const auto& entry : fs::directory_iterator(".")) {
+            string name = entry.path().filename().string();
+            if (name != GIT_DIR && name != executable_name) {
+                ops.push_back({CheckoutOp::REMOVE, name, ""});
+            }
+        }
+        collectTree(tree_sha, "", executable_name, ops);
+    }
+    
+    stats.diff_ms = elapsedMs(started);
+    
+    applyCheckout(ops, stats);
+    writeIndex();
+    
+    // Update HEAD
+    ofstream head(HEAD_FILE);
+    head << commit_sha;
+    return stats;
+}
+
+    // Packs every loose and packed object into a single new pack, storing
+    // similar objects as deltas, then removes the loose copies and old packs.
+    // `window` is how many preceding objects are tried as delta bases and
+    // `max_depth` bounds the length of delta chains.
+    GcResult gc(size_t window = 10, size_t max_depth = 50) {
+        Trace::Span span("gc");
+        loadPacks();
+
+        struct Candidate {
+            string sha;
+            int type;
+            uint64_t size;
+            uint32_t name_hash = 0;
+            uint64_t offset = 0;
+            uint32_t crc = 0;
+            size_t depth = 0;
+        };
+
+        // Every object, loose or packed, exactly once
+        vector<string> loose = looseObjects();
+        map<string, Candidate> objects;
+        for (const auto& sha : loose) {
+            objects[sha].sha = sha;
+        }
+        for (const auto& pack : packs) {
+            for (uint32_t i = 0; i < pack->count; i++) {
+                string sha = toHex(pack->sha(i));
+                objects[sha].sha = sha;
+            }
+        }
+
+        GcResult result;
+        if (objects.empty()) return result;
+
+        // First pass: learn types and sizes from the headers, and borrow
+        // file names from trees so objects at the same path end up next to
+        // each other. Only trees are inflated, and none are cached.
+        for (auto& [sha, candidate] : objects) {
+            ObjectInfo info = objectInfo(sha);
+            candidate.type = packTypeCode(info.type);
+            candidate.size = info.size;
+            if (info.type == "tree") {
+                ObjectView object = readObject(sha, false);
+                for (const auto& entry : TreeView(object.content())) {
+                    auto it = objects.find(entry.hex());
+                    if (it != objects.end()) it->second.name_hash = deltaNameHash(entry.name);
+                }
+            }
+        }
+
+        vector<Candidate*> order;
+        for (auto& [sha, candidate] : objects) order.push_back(&candidate);
+        sort(order.begin(), order.end(), [](const Candidate* a, const Candidate* b) {
+            if (a->type != b->type) return a->type < b->type;
+            if (a->name_hash != b->name_hash) return a->name_hash < b->name_hash;
+            if (a->size != b->size) return a->size > b->size;
+            return a->sha < b->sha;
+        });
+
+        string pack_dir = OBJECTS_DIR + "/pack";
+        fs::create_directories(pack_dir);
+        string tmp_pack = pack_dir + "/tmp_pack_XXXXXX";
+        int fd = mkstemp(tmp_pack.data());
+        if (fd < 0) {
+            throw runtime_error("Cannot create temporary pack file");
+        }
+        close(fd);
+
+        ofstream pack_file(tmp_pack, ios::binary | ios::trunc);
+        Hasher pack_hasher;
+        uint64_t written = 0;
+        auto emit = [&](const string& bytes) {
+            pack_file.write(bytes.data(), bytes.size());
+            pack_hasher.update(bytes.data(), bytes.size());
+            written += bytes.size();
+        };
+
+        string header("PACK", 4);
+        putBE32(header, 2);
+        putBE32(header, order.size());
+        emit(header);
+
+        // Second pass: slide a window over the sorted objects and store each
+        // one as a delta against the window member that gives the smallest
+        // delta, if any is less than half the object's size
+        struct WindowSlot {
+            Candidate* candidate;
+            ObjectView object;
+        };
+        deque<WindowSlot> recent;
+        string delta, best_delta;
+        for (Candidate* candidate : order) {
+            ObjectView object = readObject(candidate->sha, false);
+            string_view content = object.content();
+
+            const WindowSlot* best = nullptr;
+            for (const auto& slot : recent) {
+                if (slot.candidate->type != candidate->type || slot.candidate->depth >= max_depth) continue;
+                size_t limit = (best ? best_delta.size() : content.size() / 2);
+                if (limit < 32) continue;
+                if (createDelta(slot.object.content(), content, limit - 1, delta)) {
+                    best = &slot;
+                    swap(best_delta, delta);
+                }
+            }
+
+            candidate->offset = written;
+            string entry;
+            if (best) {
+                candidate->depth = best->candidate->depth + 1;
+                putPackObjectHeader(entry, PACK_OFS_DELTA, best_delta.size());
+                putDeltaOffset(entry, candidate->offset - best->candidate->offset);
+                entry += Deflater::compress(best_delta, compression.pack);
+                result.deltas++;
+            } else {
+                putPackObjectHeader(entry, candidate->type, content.size());
+                int level = candidate->type == PACK_BLOB && looksIncompressible(content.data(), content.size())
+                                ? Z_NO_COMPRESSION
+                                : compression.pack;
+                entry += Deflater::compress(content, level);
+            }
+            candidate->crc = crc32(0, reinterpret_cast<const Bytef*>(entry.data()), entry.size());
+            emit(entry);
+
+            if (window > 0) {
+                recent.push_back({candidate, move(object)});
+                if (recent.size() > window) recent.pop_front();
+            }
+        }
+
+        unsigned char pack_checksum[SHA_DIGEST_LENGTH];
+        pack_hasher.finish(pack_checksum);
+        pack_file.write(reinterpret_cast<char*>(pack_checksum), SHA_DIGEST_LENGTH);
+        pack_file.close();
+        if (!pack_file) {
+            fs::remove(tmp_pack);
+            throw runtime_error("Failed to write pack file");
+        }
+
+        // Index tables, in SHA order (map order)
+        string idx(PACK_IDX_SIGNATURE, 4);
+        putBE32(idx, PACK_IDX_VERSION);
+        uint32_t fanout[256] = {};
+        for (const auto& [sha, candidate] : objects) {
+            fanout[hexValue(sha[0]) << 4 | hexValue(sha[1])]++;
+        }
+        for (int i = 1; i < 256; i++) fanout[i] += fanout[i - 1];
+        for (uint32_t count : fanout) putBE32(idx, count);
+        for (const auto& [sha, candidate] : objects) {
+            unsigned char raw[SHA_DIGEST_LENGTH];
+            fromHex(sha, raw);
+            idx.append(reinterpret_cast<char*>(raw), SHA_DIGEST_LENGTH);
+        }
+        for (const auto& [sha, candidate] : objects) putBE32(idx, candidate.crc);
+        string large_offsets;
+        for (const auto& [sha, candidate] : objects) {
+            if (candidate.offset < 0x80000000u) {
+                putBE32(idx, candidate.offset);
+            } else {
+                putBE32(idx, 0x80000000u | uint32_t(large_offsets.size() / 8));
+                putBE64(large_offsets, candidate.offset);
+            }
+        }
+        idx += large_offsets;
+        idx.append(reinterpret_cast<char*>(pack_checksum), SHA_DIGEST_LENGTH);
+        unsigned char idx_checksum[SHA_DIGEST_LENGTH];
+        Hasher::hash(idx.data(), idx.size(), idx_checksum);
+        idx.append(reinterpret_cast<char*>(idx_checksum), SHA_DIGEST_LENGTH);
+
+        string name = "pack-" + toHex(pack_checksum);
+        string pack_path = pack_dir + "/" + name;
+        {
+            ofstream idx_file(pack_path + ".idx.tmp", ios::binary | ios::trunc);
+            idx_file.write(idx.data(), idx.size());
+            idx_file.close();
+            if (!idx_file) {
+                fs::remove(tmp_pack);
+                fs::remove(pack_path + ".idx.tmp");
+                throw runtime_error("Failed to write pack index");
+            }
+        }
+
+        // The loose copies and old packs are deleted below, so unless
+        // core.fsyncObjects is none the new pack must be on disk first:
+        // both files before they are renamed, the directory after
+        bool durable = fsync_mode != FsyncMode::NONE;
+        if (durable && (!syncPath(tmp_pack) || !syncPath(pack_path + ".idx.tmp"))) {
+            fs::remove(tmp_pack);
+            fs::remove(pack_path + ".idx.tmp");
+            throw runtime_error("Failed to sync pack " + name);
+        }
+        // The pack must be in place before its index makes it visible
+        fs::rename(tmp_pack, pack_path + ".pack");
+        fs::rename(pack_path + ".idx.tmp", pack_path + ".idx");
+        if (durable && !syncPath(pack_dir)) {
+            throw runtime_error("Failed to sync " + pack_dir);
+        }
+
+        // Everything now lives in the new pack: drop loose copies and old packs
+        vector<string> old_packs;
+        for (const auto& pack : packs) {
+            if (pack->path != pack_path) old_packs.push_back(pack->path);
+        }
+        unloadPacks();
+        for (const auto& old : old_packs) {
+            fs::remove(old + ".idx");
+            fs::remove(old + ".pack");
+        }
+        for (const auto& sha : loose) {
+            string dir = OBJECTS_DIR + "/" + sha.substr(0, 2);
+            fs::remove(dir + "/" + sha.substr(2));
+            error_code ec;
+            if (fs::is_empty(dir, ec)) fs::remove(dir, ec);
+        }
+
+        result.pack_name = name;
+        result.objects = order.size();
+        result.graph_commits = writeCommitGraph();
+        writeBloomFilters();
+        return result;
+    }
+
+    // fsync of a file or directory
+    static bool syncPath(const string& path) {
+        Trace::Span step("fsync", false);
+        Trace::count(Trace::SYS_FSYNC);
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        bool ok = fsync(fd) == 0;
+        close(fd);
+        return ok;
+    }
+
+    // Inflates and re-hashes every loose and packed object on the thread
+    // pool and checks each pack's trailing checksums, then follows tree,
+    // commit and chunk-list references to report missing objects and
+    // objects nothing refers to. Blobs are hashed as they inflate, so
+    // memory per worker stays at one delta result beside the shared
+    // delta base cache.
+    FsckResult fsck() {
+        Trace::Span span("fsck");
+        loadPacks();
+        loadIndex();
+        FsckResult result;
+        mutex result_mutex;
+        auto report = [&](FsckProblem::Kind kind, string type, string sha, string detail) {
+            lock_guard<mutex> lock(result_mutex);
+            result.problems.push_back({kind, move(type), move(sha), move(detail)});
+        };
+
+        vector<FsckItem> items;
+        for (const auto& sha : looseObjects()) {
+            FsckItem item;
+            fromHex(sha, item.id.data());
+            items.push_back(item);
+        }
+        for (size_t p = 0; p < packs.size(); p++) {
+            for (uint32_t i = 0; i < packs[p]->count; i++) {
+                FsckItem item;
+                memcpy(item.id.data(), packs[p]->sha(i), SHA_DIGEST_LENGTH);
+                item.pack = p;
+                item.offset = packs[p]->offset(i);
+                items.push_back(item);
+            }
+        }
+        // Packed entries in offset order, so a delta usually finds its base
+        // still in the delta base cache
+        sort(items.begin(), items.end(), [](const FsckItem& a, const FsckItem& b) {
+            return tie(a.pack, a.offset) < tie(b.pack, b.offset);
+        });
+
+        vector<FsckChecked> checked(items.size());
+        atomic<uint64_t> bytes{0};
+        {
+            ThreadPool pool(workerCount());
+            for (const auto& pack : packs) {
+                pool.submit([&, pack = pack.get()] {
+                    string error = packChecksumError(*pack);
+                    if (!error.empty()) {
+                        report(FsckProblem::CORRUPT, "pack", fs::path(pack->path).filename().string() + ".pack", error);
+                    }
+                });
+            }
+            for (size_t start = 0; start < items.size(); start += FSCK_BATCH) {
+                pool.submit([&, start] {
+                    for (size_t i = start; i < min(start + FSCK_BATCH, items.size()); i++) {
+                        try {
+                            checked[i] = checkObject(items[i]);
+                            bytes += checked[i].size;
+                        } catch (const exception& e) {
+                            report(FsckProblem::CORRUPT, "", toHex(items[i].id.data()), e.what());
+                        }
+                    }
+                });
+            }
+            pool.wait();
+        }
+
+        // Corrupt objects stay present (with an unknown type), so objects
+        // referring to them are not reported a second time as broken
+        unordered_map<ObjectId, string_view, ObjectIdHash> present;
+        for (size_t i = 0; i < items.size(); i++) {
+            auto [it, inserted] = present.emplace(items[i].id, checked[i].type);
+            if (!inserted && it->second.empty()) it->second = checked[i].type;
+        }
+
+        unordered_set<ObjectId, ObjectIdHash> referenced;
+        unordered_set<ObjectId, ObjectIdHash> missing;
+        auto follow = [&](const ObjectId& to, string_view expected, const string& from) {
+            referenced.insert(to);
+            auto it = present.find(to);
+            if (it == present.end()) {
+                if (missing.insert(to).second) {
+                    report(FsckProblem::MISSING, string(expected), toHex(to.data()), "referenced by " + from);
+                }
+            } else if (!it->second.empty() && it->second != expected &&
+                       !(expected == "blob" && it->second == "chunked")) {
+                report(FsckProblem::CORRUPT, "", from,
+                       "refers to " + string(it->second) + " " + toHex(to.data()) + " as a " + string(expected));
+            }
+        };
+        for (size_t i = 0; i < items.size(); i++) {
+            for (const auto& link : checked[i].links) {
+                follow(link.to, link.expected, toHex(items[i].id.data()));
+            }
+        }
+
+        // HEAD, branches and the index keep their objects alive
+        for (const auto& tip : refTips()) {
+            ObjectId id;
+            if (fromHex(tip, id.data())) follow(id, "commit", "HEAD or a branch");
+            else report(FsckProblem::CORRUPT, "ref", tip, "not an object name");
+        }
+        for (const auto& entry : index) {
+            ObjectId id;
+            memcpy(id.data(), entry.sha1, SHA_DIGEST_LENGTH);
+            follow(id, "blob", "the index (" + entry.path + ")");
+        }
+        for (const auto& [dir, tree] : cache_tree) {
+            ObjectId id;
+            memcpy(id.data(), tree.sha1, SHA_DIGEST_LENGTH);
+            follow(id, "tree", "the index cache-tree (" + (dir.empty() ? string("root") : dir) + ")");
+        }
+
+        for (const auto& [id, type] : present) {
+            if (!referenced.count(id)) {
+                report(FsckProblem::DANGLING, type.empty() ? "object" : string(type), toHex(id.data()), "");
+            }
+        }
+
+        sort(result.problems.begin(), result.problems.end(), [](const FsckProblem& a, const FsckProblem& b) {
+            return tie(a.kind, a.sha) < tie(b.kind, b.sha);
+        });
+        result.objects = items.size();
+        result.packs = packs.size();
+        result.bytes = bytes;
+        return result;
+    }
+
+private:
+    static constexpr size_t LOG_BATCH = 64;
+
+    // Objects per fsck task, and the inflate piece size for streamed objects
+    static constexpr size_t FSCK_BATCH = 256;
+    static constexpr size_t FSCK_PIECE = 64 << 10;
+
+    struct FsckItem {
+        ObjectId id{};
+        long pack = -1;  // index into packs; -1 = loose
+        uint64_t offset = 0;
+    };
+
+    struct FsckLink {
+        ObjectId to;
+        string_view expected;  // "tree", "blob" or "commit"
+    };
+
+    struct FsckChecked {
+        string_view type;  // empty when the object failed its checks
+        uint64_t size = 0;
+        vector<FsckLink> links;
+    };
+
+    static string packChecksumError(const Pack& pack) {
+        unsigned char digest[SHA_DIGEST_LENGTH];
+        if (pack.size < 12 + SHA_DIGEST_LENGTH || memcmp(pack.data, "PACK", 4) != 0) return "bad pack header";
+        if (getBE32(pack.data + 8) != pack.count) return "pack and index disagree on the object count";
+        Hasher::hash(pack.data, pack.size - SHA_DIGEST_LENGTH, digest);
+        if (memcmp(digest, pack.data + pack.size - SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH) != 0) {
+            return "pack checksum mismatch";
+        }
+        Hasher::hash(pack.idx, pack.idx_size - SHA_DIGEST_LENGTH, digest);
+        if (memcmp(digest, pack.idx + pack.idx_size - SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH) != 0) {
+            return "index checksum mismatch";
+        }
+        return "";
+    }
+
+    // Inflates a whole zlib stream, handing the output to `sink` in
+    // FSCK_PIECE pieces; returns the inflated size
+    static uint64_t inflatePieces(const unsigned char* in, size_t avail,
+                                  const function<void(const char*, size_t)>& sink) {
+        thread_local unique_ptr<char[]> piece(new char[FSCK_PIECE]);
+        z_stream strm{};
+        if (inflateInit(&strm) != Z_OK) {
+            throw runtime_error("Decompression initialization failed");
+        }
+        strm.next_in = (Bytef*)in;
+        strm.avail_in = avail;
+        uint64_t total = 0;
+        try {
+            int ret = Z_OK;
+            while (ret != Z_STREAM_END) {
+                strm.next_out = (Bytef*)piece.get();
+                strm.avail_out = FSCK_PIECE;
+                ret = inflate(&strm, Z_NO_FLUSH);
+                if (ret == Z_BUF_ERROR) throw runtime_error("truncated zlib stream");
+                if (ret != Z_OK && ret != Z_STREAM_END) throw runtime_error("corrupt zlib stream");
+                size_t have = FSCK_PIECE - strm.avail_out;
+                total += have;
+                if (have) sink(piece.get(), have);
+            }
+        } catch (...) {
+            inflateEnd(&strm);
+            throw;
+        }
+        inflateEnd(&strm);
+        return total;
+    }
+
+    // Re-hashes one object and collects the objects it refers to. Blobs
+    // (loose or undeltified) are streamed; trees, commits and chunk lists
+    // are kept to be parsed.
+    FsckChecked checkObject(const FsckItem& item) {
+        Hasher hasher;
+        FsckChecked out;
+        string kept;
+        string_view content;
+        shared_ptr<const ObjectData> resolved;
+
+        if (item.pack < 0) {
+            string sha = toHex(item.id.data());
+            string path = OBJECTS_DIR + "/" + sha.substr(0, 2) + "/" + sha.substr(2);
+            Trace::count(Trace::SYS_OPEN);
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) throw runtime_error("cannot open loose object");
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size == 0) {
+                close(fd);
+                throw runtime_error("empty loose object file");
+            }
+            size_t map_size = st.st_size;
+            void* map = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (map == MAP_FAILED) throw runtime_error("cannot map loose object");
+
+            string header;
+            bool in_header = true, keep = false;
+            uint64_t declared = 0;
+            try {
+                inflatePieces(static_cast<const unsigned char*>(map), map_size, [&](const char* p, size_t n) {
+                    hasher.update(p, n);
+                    if (in_header) {
+                        const char* nul = static_cast<const char*>(memchr(p, '\0', n));
+                        header.append(p, nul ? nul - p : n);
+                        if (!nul) {
+                            if (header.size() > 64) throw runtime_error("bad object header");
+                            return;
+                        }
+                        in_header = false;
+                        size_t space = header.find(' ');
+                        if (space == string::npos) throw runtime_error("bad object header");
+                        out.type = objectTypeName(string_view(header).substr(0, space));
+                        auto [end, ec] = from_chars(header.data() + space + 1, header.data() + header.size(), declared);
+                        if (ec != errc() || end != header.data() + header.size()) {
+                            throw runtime_error("bad object header");
+                        }
+                        keep = out.type != "blob";
+                        n -= nul + 1 - p;
+                        p = nul + 1;
+                    }
+                    out.size += n;
+                    if (keep) kept.append(p, n);
+                });
+            } catch (...) {
+                munmap(map, map_size);
+                throw;
+            }
+            munmap(map, map_size);
+            if (in_header) throw runtime_error("bad object header");
+            if (out.size != declared) {
+                throw runtime_error("header says " + to_string(declared) + " bytes, content has " +
+                                    to_string(out.size));
+            }
+            content = kept;
+        } else {
+            const Pack& pack = *packs[item.pack];
+            PackEntryHeader header = parsePackEntryHeader(pack, item.offset);
+            if (header.type != PACK_BLOB) {
+                // Through the base cache: later entries are often deltas on this one
+                resolved = readDeltaBase(pack, item.offset);
+                out.type = resolved->type;
+                out.size = resolved->size;
+                content = string_view(resolved->bytes.get(), resolved->size);
+            } else {
+                out.type = packTypeName(header.type);
+            }
+            string object_header = string(out.type) + " " + to_string(resolved ? resolved->size : header.size);
+            hasher.update(object_header.data(), object_header.size() + 1);  // with the NUL
+            if (resolved) {
+                hasher.update(content.data(), content.size());
+            } else {
+                size_t avail = pack.data + pack.size - SHA_DIGEST_LENGTH - header.data;
+                out.size = inflatePieces(header.data, avail, [&](const char* p, size_t n) { hasher.update(p, n); });
+                if (out.size != header.size) {
+                    throw runtime_error("pack entry says " + to_string(header.size) + " bytes, content has " +
+                                        to_string(out.size));
+                }
+            }
+        }
+        Trace::count(Trace::OBJECTS_READ);
+        Trace::count(Trace::BYTES_INFLATED, out.size);
+        Trace::count(Trace::OBJECTS_HASHED);
+        Trace::count(Trace::BYTES_HASHED, out.size);
+
+        unsigned char digest[SHA_DIGEST_LENGTH];
+        hasher.finish(digest);
+        if (memcmp(digest, item.id.data(), SHA_DIGEST_LENGTH) != 0) {
+            throw runtime_error("content hashes to " + toHex(digest));
+        }
+
+        auto link = [&](string_view hex, string_view expected, const char* what) {
+            FsckLink l{{}, expected};
+            if (!fromHex(hex, l.to.data())) throw runtime_error(string("bad ") + what + " reference");
+            out.links.push_back(l);
+        };
+        if (out.type == "tree") {
+            for (const auto& entry : TreeView(content)) {
+                link(entry.hex(), entry.isTree() ? "tree" : "blob", "tree entry");
+            }
+        } else if (out.type == "commit") {
+            CommitView commit(content);
+            link(commit.tree(), "tree", "tree");
+            if (!commit.parent().empty()) link(commit.parent(), "commit", "parent");
+        } else if (out.type == "chunked") {
+            size_t pos = content.find('\n');
+            while (pos != string_view::npos && pos + 1 < content.size()) {
+                link(content.substr(pos + 1, SHA_DIGEST_LENGTH * 2), "blob", "chunk");
+                pos = content.find('\n', pos + 1);
+            }
+        }
+        return out;
+    }
+
+    struct CheckoutOp {
+        enum Kind { REMOVE, MKDIR, WRITE } kind;
+        string path;
+        string sha;
+    };
+
+    // Same rule as git: a NUL in the first 8000 bytes means binary
+    static bool looksBinary(string_view data) {
+        return data.substr(0, 8000).find('\0') != string_view::npos;
+    }
+
+    // Index vs the HEAD tree. Directories whose cache-tree entry matches the
+    // HEAD tree are skipped without being read.
+    void collectStaged(vector<StatusEntry>& staged) {
+        vector<bool> covered(index.size(), false);
+        string head_sha = headCommit();
+        if (!head_sha.empty()) {
+            compareStagedTree(commitTree(head_sha), "", covered, staged);
+        }
+        for (size_t i = 0; i < index.size(); i++) {
+            if (!covered[i]) staged.push_back({StatusEntry::ADDED, index[i].path});
+        }
+        sort(staged.begin(), staged.end(),
+             [](const StatusEntry& a, const StatusEntry& b) { return a.path < b.path; });
+    }
+
+    void compareStagedTree(const string& tree_sha, const string& prefix, vector<bool>& covered,
+                           vector<StatusEntry>& staged) {
+        auto cached = cache_tree.find(prefix);
+        unsigned char raw[SHA_DIGEST_LENGTH];
+        if (cached != cache_tree.end() && fromHex(tree_sha, raw) &&
+            memcmp(raw, cached->second.sha1, SHA_DIGEST_LENGTH) == 0) {
+            // Every index entry below this directory is unchanged
+            auto begin = index.begin(), end = index.end();
+            if (!prefix.empty()) {
+                auto by_path = [](const IndexEntry& e, const string& p) { return e.path < p; };
+                begin = lower_bound(index.begin(), index.end(), prefix + "/", by_path);
+                end = lower_bound(begin, index.end(), prefix + "0", by_path);  // '0' follows '/'
+            }
+            fill(covered.begin() + (begin - index.begin()), covered.begin() + (end - index.begin()), true);
+            return;
+        }
+
+        for (const auto& entry : TreeView(readObject(tree_sha))) {
+            string path = childPath(prefix, string(entry.name));
+            if (entry.isTree()) {
+                compareStagedTree(entry.hex(), path, covered, staged);
+                continue;
+            }
+            const IndexEntry* staged_entry = findIndexEntry(path);
+            if (!staged_entry) {
+                staged.push_back({StatusEntry::DELETED, path});
+                continue;
+            }
+            covered[staged_entry - index.data()] = true;
+            if (entry.sha.size() == SHA_DIGEST_LENGTH
+                    ? memcmp(entry.sha.data(), staged_entry->sha1, SHA_DIGEST_LENGTH) != 0
+                    : entry.sha != toHex(staged_entry->sha1)) {
+                staged.push_back({StatusEntry::MODIFIED, path});
+            }
+        }
+    }
+
+    // Files not in the index; a directory with nothing tracked below it is
+    // reported once as "dir/" without being descended into
+    void collectUntracked(const string& dir, vector<string>& untracked) {
+        vector<fs::directory_entry> entries(fs::directory_iterator(dir.empty() ? "." : dir), {});
+        sort(entries.begin(), entries.end());
+        for (const auto& entry : entries) {
+            string name = entry.path().filename().string();
+            if (dir.empty() && name == GIT_DIR) continue;
+            string path = childPath(dir, name);
+
+            if (entry.is_directory()) {
+                auto it = lower_bound(index.begin(), index.end(), path + "/",
+                                      [](const IndexEntry& e, const string& p) { return e.path < p; });
+                if (it != index.end() && it->path.rfind(path + "/", 0) == 0) {
+                    collectUntracked(path, untracked);
+                } else {
+                    untracked.push_back(path + "/");
+                }
+            } else if (!findIndexEntry(path)) {
+                untracked.push_back(path);
+            }
+        }
+    }
+
+    // Commit SHA that HEAD points at, directly or through a ref ("" if none)
+    string headCommit() {
+        ifstream head(HEAD_FILE);
+        string head_content;
+        getline(head, head_content);
+
+        if (head_content.substr(0, 5) != "ref: ") return head_content;
+
+        string sha;
+        ifstream ref_file(GIT_DIR + "/" + head_content.substr(5));
+        getline(ref_file, sha);
+        return sha;
+    }
+
+    string commitTree(const string& commit_sha) {
+        uint32_t pos;
+        if (graphPosition(commit_sha, pos)) return toHex(graph_rows[pos].tree.data());
+
+        ObjectView commit = readObject(commit_sha);
+        if (commit.type() != "commit") {
+            throw runtime_error("Not a commit object");
+        }
+
+        CommitView parsed(commit);
+        if (parsed.tree().empty()) {
+            throw runtime_error("Commit has no tree: " + commit_sha);
+        }
+        return string(parsed.tree());
+    }
+
+    static string childPath(const string& prefix, const string& name) {
+        return prefix.empty() ? name : prefix + "/" + name;
+    }
+
+    // Every directory and file below a tree, parents before children
+    void collectTree(const string& tree_sha, const string& prefix, const string& executable_name,
+                     vector<CheckoutOp>& ops) {
+        ObjectView tree = readObject(tree_sha);
+        if (tree.type() != "tree") {
+            throw runtime_error("Not a tree object");
+        }
+
+        for (const auto& entry : TreeView(tree.content())) {
+            // Skip if this is the executable
+            if (entry.name == executable_name) continue;
+
+            string path = childPath(prefix, string(entry.name));
+            if (entry.isTree()) {
+                ops.push_back({CheckoutOp::MKDIR, path, ""});
+                collectTree(entry.hex(), path, executable_name, ops);
+            } else {
+                ops.push_back({CheckoutOp::WRITE, path, entry.hex()});
+            }
+        }
+    }
+
+    // Operations that turn tree `from` into tree `to`. Entries with equal
+    // SHAs are skipped without being read, so only subtrees that actually
+    // differ are visited.
+    void diffTrees(const string& from, const string& to, const string& prefix,
+                   const string& executable_name, vector<CheckoutOp>& ops) {
+        // The entry views point into these two objects
+        ObjectView from_tree = readObject(from), to_tree = readObject(to);
+        map<string_view, TreeEntry> old_entries, new_entries;
+        for (const auto& entry : TreeView(from_tree.content())) {
+            old_entries[entry.name] = entry;
+        }
+        for (const auto& entry : TreeView(to_tree.content())) {
+            new_entries[entry.name] = entry;
+        }
+
+        for (const auto& [name, old_entry] : old_entries) {
+            if (name != executable_name && !new_entries.count(name)) {
+                ops.push_back({CheckoutOp::REMOVE, childPath(prefix, string(name)), ""});
+            }
+        }
+
+        for (const auto& [name, entry] : new_entries) {
+            if (name == executable_name) continue;
+
+            string path = childPath(prefix, string(name));
+            string sha = entry.hex();
+            bool is_dir = entry.isTree();
+            auto old_it = old_entries.find(name);
+            if (old_it == old_entries.end()) {
+                // New path
+                if (is_dir) {
+                    ops.push_back({CheckoutOp::MKDIR, path, ""});
+                    collectTree(sha, path, executable_name, ops);
+                } else {
+                    ops.push_back({CheckoutOp::WRITE, path, sha});
+                }
+                continue;
+            }
+
+            const TreeEntry& old_entry = old_it->second;
+            if (old_entry.sha == entry.sha && old_entry.mode == entry.mode) continue;
+
+            bool was_dir = old_entry.isTree();
+            if (is_dir && was_dir) {
+                diffTrees(old_entry.hex(), sha, path, executable_name, ops);
+            } else if (is_dir) {
+                ops.push_back({CheckoutOp::REMOVE, path, ""});
+                ops.push_back({CheckoutOp::MKDIR, path, ""});
+                collectTree(sha, path, executable_name, ops);
+            } else {
+                if (was_dir) ops.push_back({CheckoutOp::REMOVE, path, ""});
+                ops.push_back({CheckoutOp::WRITE, path, sha});
+            }
+        }
+    }
+
+    static double elapsedMs(chrono::steady_clock::time_point since) {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - since).count();
+    }
+
+    // Runs removals, then directory creation in one pass, then blob
+    // inflate + file write on the thread pool, keeping the index stat cache
+    // in step with every path touched. Workers reserve each blob's size
+    // against a byte budget before inflating it, so a run of huge files
+    // cannot pile up in memory.
+    void applyCheckout(vector<CheckoutOp>& ops, CheckoutStats& stats) {
+        stable_sort(ops.begin(), ops.end(),
+                    [](const CheckoutOp& a, const CheckoutOp& b) { return a.kind < b.kind; });
+        auto first_mkdir = find_if(ops.begin(), ops.end(),
+                                   [](const CheckoutOp& op) { return op.kind != CheckoutOp::REMOVE; });
+        auto first_write = find_if(first_mkdir, ops.end(),
+                                   [](const CheckoutOp& op) { return op.kind == CheckoutOp::WRITE; });
+
+        auto phase = chrono::steady_clock::now();
+        for (const auto& op : ops) {
+            invalidateCacheTree(op.path);
+        }
+        for (auto it = ops.begin(); it != first_mkdir; ++it) {
+            fs::remove_all(it->path);
+            string prefix = it->path + "/";
+            index.erase(remove_if(index.begin(), index.end(),
+                                  [&](const IndexEntry& e) {
+                                      return e.path == it->path || e.path.rfind(prefix, 0) == 0;
+                                  }),
+                        index.end());
+            stats.paths_removed++;
+        }
+        stats.remove_ms = elapsedMs(phase);
+
+        // Also covers parents of written files that vanished from the
+        // working tree since HEAD was checked out
+        phase = chrono::steady_clock::now();
+        set<string> dirs;
+        for (auto it = first_mkdir; it != ops.end(); ++it) {
+            string dir = it->kind == CheckoutOp::MKDIR ? it->path : fs::path(it->path).parent_path().string();
+            if (!dir.empty()) dirs.insert(dir);
+        }
+        for (const auto& dir : dirs) {
+            fs::create_directories(dir);
+        }
+        for (auto it = first_mkdir; it != first_write; ++it) {
+            setCheckoutPermissions(it->path);
+        }
+        stats.mkdir_ms = elapsedMs(phase);
+
+        phase = chrono::steady_clock::now();
+        size_t writes = ops.end() - first_write;
+        vector<IndexEntry> written(writes);
+        atomic<uint64_t> bytes{0};
+        ByteBudget budget(configSize("checkout.inflightbytes", DEFAULT_CHECKOUT_INFLIGHT));
+        {
+            // Small blobs are written CHECKOUT_BATCH at a time through an
+            // IoBatch; chunked and large ones stream, one task each
+            size_t batches = (writes + CHECKOUT_BATCH - 1) / CHECKOUT_BATCH;
+            ThreadPool pool(min(workerCount(), max<size_t>(batches, 1)));
+            for (size_t start = 0; start < writes; start += CHECKOUT_BATCH) {
+                pool.submit([&, start] {
+                    vector<size_t> small;
+                    uint64_t small_bytes = 0;
+                    for (size_t i = start; i < min(start + CHECKOUT_BATCH, writes); i++) {
+                        ObjectInfo info = objectInfo(first_write[i].sha);
+                        if (info.type == "blob" && info.size <= SMALL_BLOB) {
+                            small.push_back(i);
+                            small_bytes += info.size;
+                            continue;
+                        }
+                        uint64_t size = info.size;
+                        pool.submit([&, i, size] {
+                            const CheckoutOp& op = first_write[i];
+                            budget.acquire(size);
+                            try {
+                                writeCheckoutFile(op);
+                            } catch (...) {
+                                budget.release(size);
+                                throw;
+                            }
+                            budget.release(size);
+                            written[i] = statCheckedOut(op.path, op.sha);
+                            bytes += size;
+                        });
+                    }
+                    if (small.empty()) return;
+                    budget.acquire(small_bytes);
+                    try {
+                        writeCheckoutBatch(&*first_write, small, written);
+                    } catch (...) {
+                        budget.release(small_bytes);
+                        throw;
+                    }
+                    budget.release(small_bytes);
+                    bytes += small_bytes;
+                });
+            }
+            pool.wait();
+        }
+        for (auto& entry : written) {
+            stageEntry(move(entry));
+        }
+        stats.files_written = writes;
+        stats.bytes_written = bytes;
+        stats.write_ms = elapsedMs(phase);
+    }
+
+    // Files per pool task when checking out small blobs
+    static constexpr size_t CHECKOUT_BATCH = 32;
+
+    // Writes ops[i] for each i in `batch` (small plain blobs): the objects
+    // are read first, then the files are opened, written, closed and
+    // stat'ed one IoBatch round each
+    void writeCheckoutBatch(const CheckoutOp* ops, const vector<size_t>& batch, vector<IndexEntry>& written) {
+        vector<ObjectView> blobs;
+        for (size_t i : batch) {
+            blobs.push_back(readObject(ops[i].sha, false));
+        }
+
+        IoBatch opens(use_io_uring);
+        for (size_t i : batch) {
+            opens.open(ops[i].path, O_WRONLY | O_CREAT | O_TRUNC, 0766);
+        }
+        opens.run();
+        Trace::count(Trace::SYS_OPEN, batch.size());
+
+        IoBatch writes(use_io_uring);
+        IoBatch closes(use_io_uring);
+        vector<int> fds(batch.size());
+        for (size_t k = 0; k < batch.size(); k++) {
+            fds[k] = opens.result(k);
+            if (fds[k] < 0) continue;
+            writes.write(fds[k], blobs[k].content().data(), blobs[k].size());
+        }
+        writes.run();
+
+        // Short writes are rare (full disk, signals): finish them directly
+        string failed;
+        size_t write_index = 0;
+        for (size_t k = 0; k < batch.size(); k++) {
+            if (fds[k] < 0) {
+                if (failed.empty()) failed = ops[batch[k]].path;
+                continue;
+            }
+            long done = writes.result(write_index++);
+            string_view data = blobs[k].content();
+            while (done >= 0 && size_t(done) < data.size()) {
+                ssize_t n = pwrite(fds[k], data.data() + done, data.size() - done, done);
+                if (n < 0 && errno == EINTR) continue;
+                done = n <= 0 ? -1 : done + n;
+            }
+            if (done < 0 && failed.empty()) failed = ops[batch[k]].path;
+            closes.close(fds[k]);
+        }
+        closes.run();
+        if (!failed.empty()) {
+            throw runtime_error("Failed to write " + failed);
+        }
+
+        vector<struct statx> stx(batch.size());
+        IoBatch stats(use_io_uring);
+        for (size_t k = 0; k < batch.size(); k++) {
+            stats.statx(ops[batch[k]].path, &stx[k]);
+        }
+        stats.run();
+        Trace::count(Trace::SYS_STAT, batch.size());
+
+        for (size_t k = 0; k < batch.size(); k++) {
+            const CheckoutOp& op = ops[batch[k]];
+            if (stats.result(k) < 0) {
+                throw runtime_error("Cannot stat " + op.path);
+            }
+            // The create mode covers new files under the usual umask; an
+            // existing file or a stricter umask needs the bits added
+            if ((stx[k].stx_mode & 0744) != 0744) {
+                setCheckoutPermissions(op.path);
+                written[batch[k]] = statCheckedOut(op.path, op.sha);
+            } else {
+                written[batch[k]] = makeIndexEntry(op.path, fromStatx(stx[k]), op.sha);
+            }
+        }
+    }
+
+    void writeCheckoutFile(const CheckoutOp& op) {
+        {
+            ofstream file(op.path, ios::binary | ios::trunc);
+            streamObject(op.sha, [&](string_view data) { file.write(data.data(), data.size()); });
+            if (!file) {
+                throw runtime_error("Failed to write " + op.path);
+            }
+        }
+        setCheckoutPermissions(op.path);
+    }
+
+    static void setCheckoutPermissions(const string& path) {
+        fs::permissions(path,
+                        fs::perms::owner_all |
+                        fs::perms::group_read |
+                        fs::perms::others_read,
+                        fs::perm_options::add);
+    }
+
+    static IndexEntry statCheckedOut(const string& path, const string& sha) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            throw runtime_error("Cannot stat " + path);
+        }
+        return makeIndexEntry(path, st, sha);
+    }
+};
+
+
+// Binary entries are "<mode> <name>\0<raw sha1>". Trees written before the
+// binary format are text lines "<mode> <name> <hex sha1>\n" and contain no
+// NUL at all, which is how they are told apart.
+void TreeIterator::parse() {
+    if (pos == end) return;
+
+    if (legacy) {
+        const char* eol = static_cast<const char*>(memchr(pos, '\n', end - pos));
+        if (!eol) eol = end;
+        next = eol == end ? end : eol + 1;
+
+        string_view line(pos, eol - pos);
+        size_t first_space = line.find(' ');
+        size_t last_space = line.rfind(' ');
+        if (first_space == string_view::npos || last_space == first_space) {
+            throw runtime_error("Malformed tree entry: " + string(line));
+        }
+        entry.mode = line.substr(0, first_space);
+        entry.name = line.substr(first_space + 1, last_space - first_space - 1);
+        entry.sha = line.substr(last_space + 1);
+        return;
+    }
+
+    const char* space = static_cast<const char*>(memchr(pos, ' ', end - pos));
+    const char* nul = space ? static_cast<const char*>(memchr(space, '\0', end - space)) : nullptr;
+    if (!nul || size_t(end - nul - 1) < SHA_DIGEST_LENGTH) {
+        throw runtime_error("Malformed tree entry");
+    }
+    entry.mode = string_view(pos, space - pos);
+    entry.name = string_view(space + 1, nul - space - 1);
+    entry.sha = string_view(nul + 1, SHA_DIGEST_LENGTH);
+    next = nul + 1 + SHA_DIGEST_LENGTH;
+}
+
+string TreeEntry::hex() const {
+    if (sha.size() != SHA_DIGEST_LENGTH) return string(sha);  // text-format tree
+    return MiniVCS::toHex(reinterpret_cast<const unsigned char*>(sha.data()));
+}
+
+TreeView::TreeView(ObjectView tree) : object(move(tree)) {
+    if (object.type() != "tree") {
+        throw runtime_error("Not a tree object");
+    }
+    data = object.content();
+    legacy = !data.empty() && !memchr(data.data(), '\0', data.size());
+}
+
+CommitView::CommitView(ObjectView commit) : object(move(commit)) {
+    if (object.type() != "commit") {
+        throw runtime_error("Not a commit object");
+    }
+    parse(object.content());
+}
+
+void CommitView::parse(string_view content) {
+    size_t pos = 0;
+    while (pos < content.size()) {
+        size_t eol = content.find('\n', pos);
+        if (eol == string_view::npos) eol = content.size();
+        string_view line = content.substr(pos, eol - pos);
+        pos = eol + 1;
+
+        if (line.empty()) {
+            if (pos < content.size()) message_text = content.substr(pos);
+            break;
+        }
+        if (line.substr(0, 5) == "tree ") {
+            tree_sha = line.substr(5);
+        } else if (line.substr(0, 7) == "parent " && parent_sha.empty()) {
+            parent_sha = line.substr(7);
+        } else if (line.substr(0, 7) == "author ") {
+            author_line = line.substr(7);
+        } else if (line.substr(0, 10) == "timestamp ") {
+            string_view digits = line.substr(10);
+            from_chars(digits.data(), digits.data() + digits.size(), time);
+        }
+    }
+}
+
+// Linear-space Myers diff over line ids: each distinct line is hashed once
+// into a small integer, so the inner loops compare ints instead of text.
+// Common prefixes and suffixes are trimmed before each bisection.
+class LineDiff {
+public:
+    LineDiff(const vector<uint32_t>& a, const vector<uint32_t>& b)
+        : a(a), b(b), deleted(a.size(), false), inserted(b.size(), false) {
+        compare(0, a.size(), 0, b.size());
+    }
+
+    const vector<uint32_t>& a;
+    const vector<uint32_t>& b;
+    vector<bool> deleted;   // per line of a
+    vector<bool> inserted;  // per line of b
+
+private:
+    void compare(size_t a_lo, size_t a_hi, size_t b_lo, size_t b_hi) {
+        while (a_lo < a_hi && b_lo < b_hi && a[a_lo] == b[b_lo]) a_lo++, b_lo++;
+        while (a_lo < a_hi && b_lo < b_hi && a[a_hi - 1] == b[b_hi - 1]) a_hi--, b_hi--;
+
+        if (a_lo == a_hi) {
+            fill(inserted.begin() + b_lo, inserted.begin() + b_hi, true);
+        } else if (b_lo == b_hi) {
+            fill(deleted.begin() + a_lo, deleted.begin() + a_hi, true);
+        } else {
+            bisect(a_lo, a_hi, b_lo, b_hi);
+        }
+    }
+
+    // Finds the middle snake by running the search from both ends at once,
+    // then diffs the two halves on either side of it
+    void bisect(size_t a_lo, size_t a_hi, size_t b_lo, size_t b_hi) {
+        const long n = a_hi - a_lo, m = b_hi - b_lo;
+        const long max_d = (n + m + 1) / 2;
+        const long offset = max_d;
+        const long length = 2 * max_d + 2;
+        vector<long> v1(length, -1), v2(length, -1);
+        v1[offset + 1] = 0;
+        v2[offset + 1] = 0;
+        const long delta = n - m;
+        const bool front = delta % 2 != 0;  // forward path meets the reverse one
+        long k1_start = 0, k1_end = 0, k2_start = 0, k2_end = 0;
+
+        for (long d = 0; d < max_d; d++) {
+            for (long k1 = -d + k1_start; k1 <= d - k1_end; k1 += 2) {
+                long k1_offset = offset + k1;
+                long x1 = (k1 == -d || (k1 != d && v1[k1_offset - 1] < v1[k1_offset + 1]))
+                              ? v1[k1_offset + 1]
+                              : v1[k1_offset - 1] + 1;
+                long y1 = x1 - k1;
+                while (x1 < n && y1 < m && a[a_lo + x1] == b[b_lo + y1]) x1++, y1++;
+                v1[k1_offset] = x1;
+                if (x1 > n) {
+                    k1_end += 2;
+                } else if (y1 > m) {
+                    k1_start += 2;
+                } else if (front) {
+                    long k2_offset = offset + delta - k1;
+                    if (k2_offset >= 0 && k2_offset < length && v2[k2_offset] != -1 &&
+                        x1 >= n - v2[k2_offset]) {
+                        split(a_lo, a_hi, b_lo, b_hi, x1, y1);
+                        return;
+                    }
+                }
+            }
+
+            for (long k2 = -d + k2_start; k2 <= d - k2_end; k2 += 2) {
+                long k2_offset = offset + k2;
+                long x2 = (k2 == -d || (k2 != d && v2[k2_offset - 1] < v2[k2_offset + 1]))
+                              ? v2[k2_offset + 1]
+                              : v2[k2_offset - 1] + 1;
+                long y2 = x2 - k2;
+                while (x2 < n && y2 < m && a[a_hi - x2 - 1] == b[b_hi - y2 - 1]) x2++, y2++;
+                v2[k2_offset] = x2;
+                if (x2 > n) {
+                    k2_end += 2;
+                } else if (y2 > m) {
+                    k2_start += 2;
+                } else if (!front) {
+                    long k1_offset = offset + delta - k2;
+                    if (k1_offset >= 0 && k1_offset < length && v1[k1_offset] != -1) {
+                        long x1 = v1[k1_offset];
+                        long y1 = offset + x1 - k1_offset;
+                        if (x1 >= n - x2) {
+                            split(a_lo, a_hi, b_lo, b_hi, x1, y1);
+                            return;
+                        }
+                    }
+                }
+            }
+        }
+
+        // No common line at all
+        fill(deleted.begin() + a_lo, deleted.begin() + a_hi, true);
+        fill(inserted.begin() + b_lo, inserted.begin() + b_hi, true);
+    }
+
+    void split(size_t a_lo, size_t a_hi, size_t b_lo, size_t b_hi, long x, long y) {
+        compare(a_lo, a_lo + x, b_lo, b_lo + y);
+        compare(a_lo + x, a_hi, b_lo + y, b_hi);
+    }
+};
+
+static vector<string_view> splitLines(string_view text) {
+    vector<string_view> lines;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t eol = text.find('\n', pos);
+        size_t end = eol == string_view::npos ? text.size() : eol + 1;
+        lines.push_back(text.substr(pos, end - pos));
+        pos = end;
+    }
+    return lines;
+}
+
+vector<DiffHunk> diffLines(string_view a, string_view b, size_t context) {
+    vector<string_view> a_lines = splitLines(a), b_lines = splitLines(b);
+
+    unordered_map<string_view, uint32_t> ids;
+    ids.reserve(a_lines.size() + b_lines.size());
+    auto toIds = [&](const vector<string_view>& lines) {
+        vector<uint32_t> out;
+        out.reserve(lines.size());
+        for (auto line : lines) out.push_back(ids.emplace(line, ids.size()).first->second);
+        return out;
+    };
+    vector<uint32_t> a_ids = toIds(a_lines), b_ids = toIds(b_lines);
+    LineDiff diff(a_ids, b_ids);
+
+    // Edit script as (op, line in a, line in b)
+    struct Edit {
+        char op;
+        size_t i, j;
+    };
+    vector<Edit> script;
+    for (size_t i = 0, j = 0; i < a_lines.size() || j < b_lines.size();) {
+        if (i < a_lines.size() && diff.deleted[i]) {
+            script.push_back({'-', i++, j});
+        } else if (j < b_lines.size() && diff.inserted[j]) {
+            script.push_back({'+', i, j++});
+        } else {
+            script.push_back({' ', i++, j++});
+        }
+    }
+
+    // Group changes closer than 2 * context lines into one hunk
+    vector<DiffHunk> hunks;
+    size_t pos = 0;
+    while (pos < script.size()) {
+        while (pos < script.size() && script[pos].op == ' ') pos++;
+        if (pos == script.size()) break;
+
+        size_t start = pos >= context ? pos - context : 0;
+        size_t last_change = pos;
+        size_t end = pos + 1;
+        for (; end < script.size(); end++) {
+            if (script[end].op != ' ') {
+                last_change = end;
+            } else if (end - last_change > 2 * context) {
+                break;
+            }
+        }
+        end = min(script.size(), last_change + context + 1);
+
+        DiffHunk hunk;
+        for (size_t k = start; k < end; k++) {
+            const Edit& edit = script[k];
+            if (edit.op != '+') hunk.old_count++;
+            if (edit.op != '-') hunk.new_count++;
+            hunk.lines.push_back({edit.op, edit.op == '+' ? b_lines[edit.j] : a_lines[edit.i]});
+        }
+        // An empty side is numbered from the line before it, as diff -u does
+        hunk.old_start = script[start].i + (hunk.old_count ? 1 : 0);
+        hunk.new_start = script[start].j + (hunk.new_count ? 1 : 0);
+        hunks.push_back(move(hunk));
+        pos = end;
+    }
+    return hunks;
+}
+
+Repository::Repository() : vcs(make_unique<MiniVCS>()) {}
+
+Repository::~Repository() = default;
+
+void Repository::init() {
+    vcs->init();
+}
+
+ObjectView Repository::read(const string& sha) {
+    return vcs->readObject(sha);
+}
+
+void Repository::stream(const string& sha, const function<void(string_view)>& sink) {
+    vcs->streamObject(sha, sink);
+}
+
+ObjectInfo Repository::info(const string& sha) {
+    return vcs->objectInfo(sha);
+}
+
+bool Repository::contains(const string& sha) {
+    return vcs->hasObject(sha);
+}
+
+TreeView Repository::readTree(const string& sha) {
+    return TreeView(vcs->readObject(sha));
+}
+
+CommitView Repository::readCommit(const string& sha) {
+    return CommitView(vcs->readObject(sha));
+}
+
+string Repository::hashObject(const string& path, bool write) {
+    return vcs->hashObject(path, write);
+}
+
+void Repository::add(const vector<string>& paths) {
+    vcs->add(paths);
+}
+
+string Repository::writeTree() {
+    return vcs->writeTree();
+}
+
+string Repository::commit(const string& message) {
+    return vcs->commit(message);
+}
+
+string Repository::head() {
+    return vcs->headCommit();
+}
+
+void Repository::revList(const string& start, const function<bool(const string&)>& visit) {
+    vcs->revList(start, visit);
+}
+
+void Repository::log(const string& start,
+                     const function<bool(const string&, const CommitView&)>& visit) {
+    vcs->log(start, visit);
+}
+
+void Repository::log(const string& start, const vector<string>& paths,
+                     const function<bool(const string&, const CommitView&)>& visit) {
+    vcs->log(start, paths, visit);
+}
+
+Status Repository::status() {
+    return vcs->status();
+}
+
+void Repository::diff(const vector<string>& paths, const function<void(const FileDiff&)>& visit) {
+    vcs->diff(paths, visit);
+}
+
+CheckoutStats Repository::checkout(const string& commit_sha) {
+    return vcs->checkout(commit_sha);
+}
+
+GcResult Repository::gc(size_t window, size_t max_depth) {
+    return vcs->gc(window, max_depth);
+}
+
+FsckResult Repository::fsck() {
+    return vcs->fsck();
+}
+
+void Repository::runFsmonitor(bool detach) {
+    vcs->runFsmonitor(detach);
+}
+
+string Repository::fsmonitorStatus() {
+    string reply = vcs->fsmonitorRequest("status");
+    if (!reply.empty() && reply.back() == '\n') reply.pop_back();
+    return reply;
+}
+
+bool Repository::stopFsmonitor() {
+    return vcs->fsmonitorRequest("quit") == "ok\n";
+}
+
+void Repository::setJobs(size_t jobs) {
+    vcs->setJobs(jobs);
+}
+
+ObjectCacheStats Repository::objectCacheStats() const {
+    return vcs->objectCacheStats();
+}
+
+}  // namespace mygit
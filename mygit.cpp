@@ -1,517 +1,252 @@
+#include <algorithm>
 #include <iostream>
-#include <fstream>
-#include <sstream>
+#include <map>
 #include <string>
 #include <vector>
-#include <map>
-#include <filesystem>
+#include <chrono>
 #include <ctime>
-#include <algorithm>
-#include <openssl/sha.h>
-#include <zlib.h>
+#include <cstdlib>
+#include <iomanip>
+#include <unistd.h>
+#include "mygit.h"
 using namespace std;
-namespace fs = filesystem;
-
-class MiniVCS {
-private:
-    const string GIT_DIR = ".mygit";
-    const string OBJECTS_DIR = GIT_DIR + "/objects";
-    const string REFS_DIR = GIT_DIR + "/refs";
-    const string HEAD_FILE = GIT_DIR + "/HEAD";
-    const string INDEX_FILE = GIT_DIR + "/index";
-
-    struct IndexEntry {
-        string path;
-        string sha1;
-        time_t timestamp;
-    };
-
-    struct Commit {
-        string tree_sha;
-        string parent_sha;
-        string message;
-        time_t timestamp;
-        string author;
-    };
-
-    vector<IndexEntry> index;
-
-    // Helper functions
-    string calculateSHA1(const string& content) {
-        unsigned char hash[SHA_DIGEST_LENGTH];
-        SHA1(reinterpret_cast<const unsigned char*>(content.c_str()), content.length(), hash);
-        
-        stringstream ss;
-        for(int i = 0; i < SHA_DIGEST_LENGTH; i++) {
-            ss << hex << setw(2) << setfill('0') << (int)hash[i];
-        }
-        return ss.str();
-    }
-
-    string compressData(const string& data) {
-        z_stream strm;
-        strm.zalloc = Z_NULL;
-        strm.zfree = Z_NULL;
-        strm.opaque = Z_NULL;
-        
-        if (deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK) {
-            throw runtime_error("Compression initialization failed");
+using namespace mygit;
+
+// Command-line front-end: argument parsing and output formatting over
+// libmygit
+
+static void catFile(Repository& vcs, const string& sha, char flag) {
+    // Type and size come from the object header alone
+    switch (flag) {
+        case 'p': {
+            // Files go through stream() so chunked ones are reassembled
+            string_view type = vcs.info(sha).type;
+            if (type == "blob" || type == "chunked") {
+                vcs.stream(sha, [](string_view data) { cout.write(data.data(), data.size()); });
+            } else {
+                ObjectView object = vcs.read(sha);
+                cout.write(object.content().data(), object.size());
+            }
+            break;
         }
-
-        vector<unsigned char> compressed;
-        const size_t CHUNK = 16384;
-        vector<unsigned char> out(CHUNK);
-
-        strm.avail_in = data.size();
-        strm.next_in = (Bytef*)data.data();
-
-        do {
-            strm.avail_out = CHUNK;
-            strm.next_out = out.data();
-
-            deflate(&strm, Z_FINISH);
-
-            compressed.insert(compressed.end(), out.data(), out.data() + CHUNK - strm.avail_out);
-        } while (strm.avail_out == 0);
-
-        deflateEnd(&strm);
-
-        return string(compressed.begin(), compressed.end());
+        case 't':
+            cout << vcs.info(sha).type;
+            break;
+        case 's':
+            cout << vcs.info(sha).size;
+            break;
+        default:
+            throw runtime_error("Invalid flag");
     }
+}
 
-    string decompressData(const string& compressed) {
-        z_stream strm;
-        strm.zalloc = Z_NULL;
-        strm.zfree = Z_NULL;
-        strm.opaque = Z_NULL;
-        strm.avail_in = 0;
-        strm.next_in = Z_NULL;
-
-        if (inflateInit(&strm) != Z_OK) {
-            throw runtime_error("Decompression initialization failed");
+// Answers one query per stdin line for the life of the process, so packs,
+// the object cache and the commit-graph stay loaded between requests.
+// Output is flushed only when no further input is already buffered.
+static void catFileBatch(Repository& vcs, bool contents) {
+    string sha;
+    while (getline(cin, sha)) {
+        size_t start = sha.find_first_not_of(" \t\r");
+        size_t end = sha.find_last_not_of(" \t\r");
+        if (start == string::npos) continue;
+        sha = sha.substr(start, end - start + 1);
+
+        // A bad object answers its own line; the session goes on
+        try {
+            if (!vcs.contains(sha)) {
+                cout << sha << " missing\n";
+            } else if (contents) {
+                ObjectView object = vcs.read(sha);
+                cout << sha << " " << object.type() << " " << object.size() << "\n";
+                cout.write(object.content().data(), object.size());
+                cout << "\n";
+            } else {
+                ObjectInfo info = vcs.info(sha);
+                cout << sha << " " << info.type << " " << info.size << "\n";
+            }
+        } catch (const runtime_error& e) {
+            cout << sha << " error\n";
+            cerr << "Error: " << e.what() << "\n";
         }
 
-        vector<unsigned char> decompressed;
-        const size_t CHUNK = 16384;
-        vector<unsigned char> out(CHUNK);
-
-        strm.avail_in = compressed.size();
-        strm.next_in = (Bytef*)compressed.data();
-
-        do {
-            strm.avail_out = CHUNK;
-            strm.next_out = out.data();
-
-            inflate(&strm, Z_NO_FLUSH);
-
-            decompressed.insert(decompressed.end(), out.data(), out.data() + CHUNK - strm.avail_out);
-        } while (strm.avail_out == 0);
-
-        inflateEnd(&strm);
-
-        return string(decompressed.begin(), decompressed.end());
-    }
-
-    void writeObject(const string& type, const string& content) {
-        string header = type + " " + to_string(content.length()) + "\0";
-        string store = header + content;
-        string sha = calculateSHA1(store);
-        
-        string compressed = compressData(store);
-        
-        string dir = OBJECTS_DIR + "/" + sha.substr(0, 2);
-        string path = dir + "/" + sha.substr(2);
-        
-        fs::create_directories(dir);
-        
-        ofstream file(path, ios::binary);
-        file.write(compressed.data(), compressed.length());
+        if (cin.rdbuf()->in_avail() <= 0) cout.flush();
     }
+    cout.flush();
+}
 
-    pair<string, string> readObject(const string& sha) {
-        string path = OBJECTS_DIR + "/" + sha.substr(0, 2) + "/" + sha.substr(2);
-        
-        ifstream file(path, ios::binary);
-        if (!file) {
-            throw runtime_error("Object not found: " + sha);
+static void lsTree(Repository& vcs, const string& sha, bool name_only) {
+    for (const auto& entry : vcs.readTree(sha)) {
+        if (name_only) {
+            // Only output the name when --name-only flag is set
+            cout << entry.name << "\n";
+            continue;
         }
-        
-        stringstream buffer;
-        buffer << file.rdbuf();
-        string compressed = buffer.str();
-        
-        string decompressed = decompressData(compressed);
-        
-        size_t null_pos = decompressed.find('\0');
-        string header = decompressed.substr(0, null_pos);
-        string content = decompressed.substr(null_pos + 1);
 
-        string len = to_string(content.size()); 
-        
-        size_t space_pos = header.find(' ');
-        string type = header.substr(0, space_pos);
-        content = content.substr(space_pos+1+len.size()); 
-        
-        return {type, content};
+        // Format the output similar to git ls-tree: <mode> <type> <hash>\t<name>
+        string mode(entry.mode);
+        string formatted_mode = string(6 - min<size_t>(mode.length(), 6), '0') + mode;
+        const char* type = entry.isTree() ? "tree" : "blob";
+        cout << formatted_mode << " " << type << " " << entry.hex() << "\t" << entry.name << "\n";
     }
+}
 
-public:
-    void init() {
-        if (fs::exists(GIT_DIR)) {
-            throw runtime_error("Repository already exists");
-        }
+static void printLogEntry(const string& sha, const CommitView& commit) {
+    cout << "\033[33mcommit " << sha << "\033[0m\n";  // Yellow color for commit hash
 
-        fs::create_directories(GIT_DIR + "/objects");
-        fs::create_directories(GIT_DIR + "/refs/heads");
-        
-        ofstream head(HEAD_FILE);
-        head << "ref: refs/heads/master";
+    time_t commit_time = commit.timestamp();
+    if (commit_time) {
+        // Convert timestamp to human-readable format
+        char time_buf[100];
+        struct tm* timeinfo = localtime(&commit_time);
+        strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S %z", timeinfo);
+        cout << "Date:   " << time_buf << "\n";
     }
 
-    string hashObject(const string& path, bool write = false) {
-        ifstream file(path, ios::binary);
-        if (!file) {
-            throw runtime_error("File not found: " + path);
-        }
-        
-        stringstream buffer;
-        buffer << file.rdbuf();
-        string content = buffer.str();
-        
-        string header = "blob " + to_string(content.length()) + "\0";
-        string store = header + content;
-        
-        string sha = calculateSHA1(store);
-        
-        if (write) {
-            writeObject("blob", content);
+    // First non-empty line of the message
+    string_view message = commit.message();
+    while (!message.empty()) {
+        size_t eol = message.find('\n');
+        string_view line = message.substr(0, eol);
+        if (!line.empty()) {
+            cout << "\n    " << line << "\n\n";
+            break;
         }
-        
-        return sha;
+        if (eol == string_view::npos) break;
+        message.remove_prefix(eol + 1);
     }
+}
 
-    void catFile(const string& sha, char flag) {
-        auto [type, content] = readObject(sha);
-        
-        switch (flag) {
-            case 'p':
-                cout << content;
-                break;
-            case 't':
-                cout << type;
-                break;
-            case 's':
-                cout << content.length();
-                break;
-            default:
-                throw runtime_error("Invalid flag");
-        }
+static const char* statusLabel(StatusEntry::Kind kind) {
+    switch (kind) {
+        case StatusEntry::ADDED: return "new file:   ";
+        case StatusEntry::MODIFIED: return "modified:   ";
+        default: return "deleted:    ";
     }
+}
 
-    string writeTree() {
-        stringstream tree_content;
-        
-        for (const auto& entry : fs::directory_iterator(".")) {
-            if (entry.path().filename().string() == GIT_DIR) continue;
-            
-            string path = entry.path().string();
-            string name = entry.path().filename().string();
-            
-            if (fs::is_directory(entry)) {
-                // Recursively handle directories
-                fs::current_path(path);
-                string subtree_sha = writeTree();
-                fs::current_path("..");
-                tree_content << "40000 " << name << " " << subtree_sha << "\n";
-            } else {
-                string sha = hashObject(path, true);
-                tree_content << "100644 " << name << " " << sha << "\n";
-            }
-        }
-        
-        string content = tree_content.str();
-        writeObject("tree", content);
-        return calculateSHA1("tree " + to_string(content.length()) + "\0" + content);
+static char statusCode(StatusEntry::Kind kind) {
+    switch (kind) {
+        case StatusEntry::ADDED: return 'A';
+        case StatusEntry::MODIFIED: return 'M';
+        default: return 'D';
     }
+}
 
-    void lsTree(const string& sha, bool nameOnly = false) {
-        // Read and validate the tree object
-        auto [type, content] = readObject(sha);
-        if (type != "tree") {
-            throw runtime_error("Not a tree object");
-        }
-
-        istringstream ss(content);
-        string mode, type1, hash, name;
-        
-        // Tree entries are stored as: <mode> <type> <hash>\t<name>
-        // We need to parse each component carefully
-        string line;
-        while (getline(ss, line)) {
-            istringstream entry(line);
-
-            // cout<<line<<endl;
-            
-            // Extract components
-            entry >> mode >> name >> hash;
-            
-            // Skip the tab character
-            // char tab;
-            // entry.get(tab);
-            
-            // Get the rest as name (might contain spaces)
-            // getline(entry, name);
-            
-            if (nameOnly) {
-                // Only output the name when --name-only flag is set
-                cout << name << "\n";
-            } else {
-                // Format the output similar to git ls-tree
-                // Convert mode to proper format (ensure 6 digits)
-                string formattedMode = string(6 - mode.length(), '0') + mode;
-                
-                // Determine if it's a directory (tree) or file (blob)
-                string entryType = (formattedMode == "040000") ? "tree" : "blob";
-                
-                // Output in format: <mode> <type> <hash>\t<name>
-                cout << formattedMode << " " << entryType << " " << hash << "\t" << name << "\n";
-            }
-        }
-    }
+// ANSI color escape, only when writing to a terminal
+static string paint(const char* code) {
+    static const bool tty = isatty(STDOUT_FILENO);
+    return tty ? string("\033[") + code + "m" : "";
+}
 
-    void add(const vector<string>& paths) {
-        for (const auto& path : paths) {
-            if (path == ".") {
-                // Add all files in current directory
-                for (const auto& entry : fs::directory_iterator(".")) {
-                    if (entry.path().filename().string() != GIT_DIR) {
-                        string entry_path = entry.path().string();
-                        string sha = hashObject(entry_path, true);
-                        IndexEntry index_entry = {
-                            entry_path,
-                            sha,
-                            static_cast<time_t>(fs::last_write_time(entry_path).time_since_epoch().count())
-                        };
-                        index.push_back(index_entry);
-                    }
-                }
-            } else {
-                if (!fs::exists(path)) {
-                    throw runtime_error("File not found: " + path);
-                }
-                string sha = hashObject(path, true);
-                IndexEntry entry = {
-                    path,
-                    sha,
-                    static_cast<time_t>(fs::last_write_time(path).time_since_epoch().count())
-                };
-                index.push_back(entry);
-            }
-        }
-        
-        // Write index to file
-        ofstream index_file(INDEX_FILE);
-        for (const auto& entry : index) {
-            index_file << entry.path << " " << entry.sha1 << " " << entry.timestamp << "\n";
-        }
+static void printStatus(const Status& status, bool short_format) {
+    if (short_format) {
+        // "XY path": X = index vs HEAD, Y = working tree vs index
+        map<string, pair<char, char>> codes;
+        for (const auto& entry : status.staged) codes[entry.path].first = statusCode(entry.kind);
+        for (const auto& entry : status.unstaged) codes[entry.path].second = statusCode(entry.kind);
+        for (const auto& [path, code] : codes) {
+            cout << (code.first ? code.first : ' ') << (code.second ? code.second : ' ') << " " << path
+                 << "\n";
+        }
+        for (const auto& path : status.untracked) cout << "?? " << path << "\n";
+        return;
     }
 
-    string commit(const string& message) {
-        string tree_sha = writeTree();
-        
-        // Read HEAD to get parent commit
-        string parent_sha;
-        ifstream head(HEAD_FILE);
-        string head_content;
-        getline(head, head_content);
-        
-        if (head_content.substr(0, 5) == "ref: ") {
-            string ref_path = GIT_DIR + "/" + head_content.substr(5);
-            if (fs::exists(ref_path)) {
-                ifstream ref_file(ref_path);
-                getline(ref_file, parent_sha);
-            }
+    if (!status.staged.empty()) {
+        cout << "Changes to be committed:\n";
+        for (const auto& entry : status.staged) {
+            cout << "\t" << paint("32") << statusLabel(entry.kind) << entry.path << paint("0") << "\n";
         }
-        
-        // Get current timestamp
-        time_t current_time = time(nullptr);
-        
-        // Create commit object with timestamp
-        stringstream commit_content;
-        commit_content << "tree " << tree_sha << "\n";
-        if (!parent_sha.empty()) {
-            commit_content << "parent " << parent_sha << "\n";
-        }
-        commit_content << "author User <user@example.com> " << current_time << "\n";
-        commit_content << "committer User <user@example.com> " << current_time << "\n";
-        commit_content << "timestamp " << current_time << "\n\n";  // Add explicit timestamp
-        commit_content << message;
-        
-        string content = commit_content.str();
-        writeObject("commit", content);
-        string commit_sha = calculateSHA1("commit " + to_string(content.length()) + "\0" + content);
-        
-        // Update HEAD
-        string ref_path = GIT_DIR + "/refs/heads/master";
-        fs::create_directories(fs::path(ref_path).parent_path());  // Ensure directory exists
-        ofstream ref_file(ref_path);
-        ref_file << commit_sha;
-        
-        // Set proper permissions for the working directory
-        fs::permissions(".", fs::perms::owner_all | fs::perms::group_read | fs::perms::others_read,
-                    fs::perm_options::add);
-        
-        return commit_sha;
+        cout << "\n";
     }
-
-    void log() {
-        // Read current HEAD
-        string current_sha;
-        ifstream head(HEAD_FILE);
-        string head_content;
-        getline(head, head_content);
-        
-        if (head_content.substr(0, 5) == "ref: ") {
-            string ref_path = GIT_DIR + "/" + head_content.substr(5);
-            if (fs::exists(ref_path)) {
-                ifstream ref_file(ref_path);
-                getline(ref_file, current_sha);
-            }
+    if (!status.unstaged.empty()) {
+        cout << "Changes not staged for commit:\n";
+        for (const auto& entry : status.unstaged) {
+            cout << "\t" << paint("31") << statusLabel(entry.kind) << entry.path << paint("0") << "\n";
         }
-        
-        // Traverse commit history
-        while (!current_sha.empty()) {
-            auto [type, content] = readObject(current_sha);
-            if (type != "commit") break;
-            
-            cout << "\033[33mcommit " << current_sha << "\033[0m\n";  // Yellow color for commit hash
-            
-            stringstream ss(content);
-            string line;
-            string parent_sha;
-            time_t commit_time = 0;
-            
-            bool message_next = false;
-            while (getline(ss, line)) {
-                if (line.substr(0, 7) == "parent ") {
-                    parent_sha = line.substr(7);
-                }
-                else if (line.substr(0, 10) == "timestamp ") {
-                    commit_time = stoll(line.substr(10));
-                    // Convert timestamp to human-readable format
-                    char time_buf[100];
-                    struct tm* timeinfo = localtime(&commit_time);
-                    strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S %z", timeinfo);
-                    cout << "Date:   " << time_buf << "\n";
-                }
-                else if (line.empty()) {
-                    message_next = true;
-                }
-                else if (message_next) {
-                    cout << "\n    " << line << "\n\n";
-                    break;
-                }
-            }
-            
-            current_sha = parent_sha;
-        }
-    }
-
-    void checkout(const string& commit_sha) {
-    auto [type, content] = readObject(commit_sha);
-    if (type != "commit") {
-        throw runtime_error("Not a commit object");
+        cout << "\n";
     }
-    
-    // Parse commit to get tree SHA
-    stringstream ss(content);
-    string line;
-    string tree_sha;
-    
-    while (getline(ss, line)) {
-        if (line.substr(0, 5) == "tree ") {
-            tree_sha = line.substr(5);
-            break;
-        }
+    if (!status.untracked.empty()) {
+        cout << "Untracked files:\n";
+        for (const auto& path : status.untracked) cout << "\t" << paint("31") << path << paint("0") << "\n";
+        cout << "\n";
     }
-    
-    // Get the name of the current executable
-    char buffer[1024];
-    ssize_t len = readlink("/proc/self/exe", buffer, sizeof(buffer)-1);
-    if (len != -1) {
-        buffer[len] = '\0';
+    if (status.staged.empty() && status.unstaged.empty() && status.untracked.empty()) {
+        cout << "nothing to commit, working tree clean\n";
     }
-    string executable_path = buffer;
-    string executable_name = fs::path(executable_path).filename().string();
-    
-    // Clear working directory (except .mygit and the executable)
-    for (const auto& entry : fs::directory_iterator(".")) {
-        if (entry.path().filename().string() != GIT_DIR && 
-            entry.path().filename().string() != executable_name) {
-            fs::remove_all(entry.path());
-        }
+}
+
+static void printRange(size_t start, size_t count) {
+    cout << start;
+    if (count != 1) cout << "," << count;
+}
+
+static void printDiff(const FileDiff& file) {
+    cout << "diff --git a/" << file.path << " b/" << file.path << "\n";
+    if (file.kind == StatusEntry::DELETED) cout << "deleted file mode 100644\n";
+    if (file.binary) {
+        cout << "Binary files a/" << file.path << " and "
+             << (file.kind == StatusEntry::DELETED ? "/dev/null" : "b/" + file.path) << " differ\n";
+        return;
     }
-    
-    // Recursively restore files from tree
-    restoreTree(tree_sha, ".", executable_name);
-    
-    // Update HEAD
-    ofstream head(HEAD_FILE);
-    head << commit_sha;
-    
-    // Set proper permissions for all restored files and directories
-    for (const auto& entry : fs::recursive_directory_iterator(".")) {
-        if (entry.path().filename().string() != GIT_DIR &&
-            entry.path().filename().string() != executable_name) {
-            fs::permissions(entry.path(), 
-                        fs::perms::owner_all | 
-                        fs::perms::group_read | 
-                        fs::perms::others_read,
-                        fs::perm_options::add);
+    cout << "--- a/" << file.path << "\n";
+    cout << "+++ " << (file.kind == StatusEntry::DELETED ? "/dev/null" : "b/" + file.path) << "\n";
+
+    for (const auto& hunk : file.hunks) {
+        cout << paint("36") << "@@ -";
+        printRange(hunk.old_start, hunk.old_count);
+        cout << " +";
+        printRange(hunk.new_start, hunk.new_count);
+        cout << " @@" << paint("0") << "\n";
+        for (const auto& line : hunk.lines) {
+            string color = line.op == ' ' ? "" : paint(line.op == '-' ? "31" : "32");
+            string_view text = line.text;
+            bool newline = !text.empty() && text.back() == '\n';
+            if (newline) text.remove_suffix(1);
+            cout << color << line.op << text << (color.empty() ? "" : paint("0")) << "\n";
+            if (!newline) cout << "\\ No newline at end of file\n";
         }
     }
 }
 
+// A small decimal count for an option value; false on anything else
+static bool parseCount(const string& value, size_t& count) {
+    if (value.empty() || value.find_first_not_of("0123456789") != string::npos || value.size() > 6) {
+        return false;
+    }
+    count = stoul(value);
+    return true;
+}
 
-private:
-     void restoreTree(const string& tree_sha, const string& path, const string& executable_name) {
-        auto [type, content] = readObject(tree_sha);
-        if (type != "tree") {
-            throw runtime_error("Not a tree object");
-        }
-        
-        stringstream ss(content);
-        string line;
-        
-        while (getline(ss, line)) {
-            stringstream line_ss(line);
-            string mode, name, sha;
-            line_ss >> mode >> name >> sha;
-            
-            // Skip if this is the executable
-            if (name == executable_name) {
-                continue;
-            }
-            
-            string full_path = path + "/" + name;
-            
-            if (mode == "40000") {
-                // Directory
-                fs::create_directories(full_path);
-                restoreTree(sha, full_path, executable_name);
-            } else {
-                // File
-                auto [blob_type, blob_content] = readObject(sha);
-                if (blob_type != "blob") {
-                    throw runtime_error("Not a blob object");
-                }
-                
-                ofstream file(full_path, ios::binary);
-                file.write(blob_content.data(), blob_content.length());
-            }
-        }
+// Takes -j <n> / -j<n> (worker threads; default one per core) from the
+// options in front of a command's arguments, args[2] onwards. Scanning
+// stops at the first non-option and at "--", which is dropped. Returns
+// false on a bad count.
+static bool takeJobsOption(Repository& vcs, vector<char*>& args) {
+    for (size_t i = 2; i < args.size(); i++) {
+        string arg = args[i];
+        if (arg == "--") {
+            args.erase(args.begin() + i);
+            return true;
+        }
+        if (arg.size() < 2 || arg[0] != '-') return true;
+        if (arg.rfind("-j", 0) != 0) continue;  // another option of the command
+
+        string value = arg.substr(2);
+        size_t used = 1;
+        if (value.empty()) {
+            if (i + 1 >= args.size()) return false;
+            value = args[i + 1];
+            used = 2;
+        }
+        size_t jobs;
+        if (!parseCount(value, jobs)) return false;
+        vcs.setJobs(jobs);
+        args.erase(args.begin() + i, args.begin() + i + used);
+        i--;
     }
-};
+    return true;
+}
 
 // Main function to handle command-line arguments
 int main(int argc, char* argv[]) {
@@ -520,10 +255,23 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    MiniVCS vcs;
     string command = argv[1];
 
     try {
+        Repository vcs;
+
+        // Only commands that run on the thread pool take -j; a commit
+        // message or a path after "--" is never read as an option
+        vector<char*> args(argv, argv + argc);
+        static const vector<string> parallel = {"add", "write-tree", "status", "checkout", "gc", "repack",
+                                                "fsck", "verify"};
+        if (find(parallel.begin(), parallel.end(), command) != parallel.end() && !takeJobsOption(vcs, args)) {
+            cerr << "Usage: -j <n> needs a number of worker threads\n";
+            return 1;
+        }
+        argc = args.size();
+        argv = args.data();
+
         if (command == "init") {
             vcs.init();
             cout << "Initialized empty repository in .mygit/\n";
@@ -552,21 +300,27 @@ int main(int argc, char* argv[]) {
             cout << sha << "\n";
         }
         else if (command == "cat-file") {
-            if (argc < 4) {
-                cerr << "Usage: ./mygit cat-file <flag> <sha>\n";
-                return 1;
-            }
-            
-            string flag_str = argv[2];
-            if (flag_str.length() != 2 || flag_str[0] != '-') {
-                cerr << "Invalid flag\n";
+            if (argc == 3 && (string(argv[2]) == "--batch" || string(argv[2]) == "--batch-check")) {
+                // Unsynced streams buffer stdin, which is what lets the batch
+                // loop see whether more requests are already waiting
+                ios::sync_with_stdio(false);
+                cin.tie(nullptr);
+                catFileBatch(vcs, string(argv[2]) == "--batch");
+            } else if (argc < 4) {
+                cerr << "Usage: ./mygit cat-file <flag> <sha> | --batch | --batch-check\n";
                 return 1;
+            } else {
+                string flag_str = argv[2];
+                if (flag_str.length() != 2 || flag_str[0] != '-') {
+                    cerr << "Invalid flag\n";
+                    return 1;
+                }
+                
+                char flag = flag_str[1];
+                string sha = argv[3];
+                
+                catFile(vcs, sha, flag);
             }
-            
-            char flag = flag_str[1];
-            string sha = argv[3];
-            
-            vcs.catFile(sha, flag);
         }
         else if (command == "write-tree") {
             string sha = vcs.writeTree();
@@ -592,7 +346,7 @@ int main(int argc, char* argv[]) {
                 sha = argv[2];
             }
             
-            vcs.lsTree(sha, name_only);
+            lsTree(vcs, sha, name_only);
         }
         else if (command == "add") {
             if (argc < 3) {
@@ -626,22 +380,128 @@ int main(int argc, char* argv[]) {
             cout << "Created commit " << sha << "\n";
         }
         else if (command == "log") {
-            vcs.log();
+            vector<string> paths;
+            if (argc >= 3) {
+                if (string(argv[2]) != "--" || argc < 4) {
+                    cerr << "Usage: ./mygit log [-- <path>...]\n";
+                    return 1;
+                }
+                paths.assign(argv + 3, argv + argc);
+            }
+            vcs.log("", paths, [](const string& sha, const CommitView& commit) {
+                printLogEntry(sha, commit);
+                return true;
+            });
+        }
+        else if (command == "gc" || command == "repack") {
+            size_t window = 10, depth = 50;
+            for (int i = 2; i < argc; i++) {
+                string arg = argv[i];
+                bool ok = false;
+                if (arg.rfind("--window=", 0) == 0) {
+                    ok = parseCount(arg.substr(9), window);
+                } else if (arg.rfind("--depth=", 0) == 0) {
+                    ok = parseCount(arg.substr(8), depth);
+                }
+                if (!ok) {
+                    cerr << "Usage: ./mygit gc [--window=<n>] [--depth=<n>]\n";
+                    return 1;
+                }
+            }
+
+            auto result = vcs.gc(window, depth);
+            if (result.objects == 0) {
+                cout << "Nothing to pack\n";
+            } else {
+                cout << "Packed " << result.objects << " objects (" << result.deltas
+                     << " deltas) into " << result.pack_name << ".pack\n";
+                cout << "Wrote commit-graph with " << result.graph_commits << " commits\n";
+            }
+        }
+        else if (command == "fsck" || command == "verify") {
+            auto start = chrono::steady_clock::now();
+            FsckResult result = vcs.fsck();
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            for (const auto& problem : result.problems) {
+                switch (problem.kind) {
+                    case FsckProblem::CORRUPT:
+                        cout << "error in " << (problem.type.empty() ? "object" : problem.type) << " "
+                             << problem.sha << ": " << problem.detail << "\n";
+                        break;
+                    case FsckProblem::MISSING:
+                        cout << "missing " << problem.type << " " << problem.sha << " (" << problem.detail << ")\n";
+                        break;
+                    case FsckProblem::DANGLING:
+                        cout << "dangling " << problem.type << " " << problem.sha << "\n";
+                        break;
+                }
+            }
+            cerr << "Checked " << result.objects << " objects (" << result.packs << " packs, "
+                 << result.bytes / (1 << 20) << " MB inflated) in " << fixed << setprecision(2) << seconds << " s\n";
+            return result.ok() ? 0 : 1;
+        }
+        else if (command == "rev-list") {
+            vcs.revList(argc >= 3 ? argv[2] : "", [](const string& sha) {
+                cout << sha << "\n";
+                return true;
+            });
+        }
+        else if (command == "status") {
+            bool short_format = argc >= 3 && (string(argv[2]) == "-s" || string(argv[2]) == "--short");
+            printStatus(vcs.status(), short_format);
+        }
+        else if (command == "diff") {
+            vector<string> paths(argv + 2, argv + argc);
+            vcs.diff(paths, printDiff);
         }
         else if (command == "checkout") {
-            if (argc < 3) {
-                cerr << "Usage: ./mygit checkout <commit_sha>\n";
+            bool verbose = argc >= 3 && string(argv[2]) == "-v";
+            if (argc < 3 + verbose) {
+                cerr << "Usage: ./mygit checkout [-v] [-j <n>] <commit_sha>\n";
                 return 1;
             }
             
-            string commit_sha = argv[2];
-            vcs.checkout(commit_sha);
+            string commit_sha = argv[2 + verbose];
+            auto stats = vcs.checkout(commit_sha);
             cout << "Checked out commit " << commit_sha << "\n";
+            if (verbose) {
+                cerr << fixed << setprecision(1)
+                     << "diff:   " << stats.diff_ms << " ms\n"
+                     << "remove: " << stats.remove_ms << " ms (" << stats.paths_removed << " paths)\n"
+                     << "mkdir:  " << stats.mkdir_ms << " ms\n"
+                     << "write:  " << stats.write_ms << " ms (" << stats.files_written << " files, "
+                     << stats.bytes_written << " bytes)\n";
+            }
+        }
+        else if (command == "fsmonitor") {
+            string action = argc >= 3 ? argv[2] : "run";
+            if (action == "run") {
+                vcs.runFsmonitor(false);
+            } else if (action == "start") {
+                vcs.runFsmonitor(true);
+                cout << "fsmonitor started\n";
+            } else if (action == "stop") {
+                if (!vcs.stopFsmonitor()) throw runtime_error("fsmonitor is not running");
+                cout << "fsmonitor stopped\n";
+            } else if (action == "status") {
+                string status = vcs.fsmonitorStatus();
+                cout << (status.empty() ? "fsmonitor is not running" : status) << "\n";
+            } else {
+                cerr << "Usage: ./mygit fsmonitor [run|start|stop|status]\n";
+                return 1;
+            }
         }
         else {
             cerr << "Unknown command: " << command << "\n";
             return 1;
         }
+
+        if (getenv("MYGIT_CACHE_STATS")) {
+            auto stats = vcs.objectCacheStats();
+            cerr << "object cache: " << stats.hits << " hits, " << stats.misses << " misses, "
+                 << stats.evictions << " evictions, " << stats.entries << " entries, "
+                 << stats.bytes << "/" << stats.budget << " bytes\n";
+        }
     }
     catch (const exception& e) {
         cerr << "Error: " << e.what() << "\n";
@@ -0,0 +1,295 @@
+// libmygit: the repository engine behind the mygit command line, usable
+// from other programs without going through the CLI.
+//
+// A Repository operates on the .mygit directory in the current working
+// directory. Objects are handed out as ObjectView values that share the
+// decompressed buffer with the object cache, so reading, iterating a tree
+// or parsing a commit never copies object data. Errors are reported as
+// std::runtime_error.
+#ifndef MYGIT_H
+#define MYGIT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace mygit {
+
+struct ObjectData {
+    std::string_view type;  // one of the static type names
+    std::unique_ptr<char[]> bytes;
+    size_t size = 0;
+};
+
+// Read-only view of a decompressed object. Copies are cheap and keep the
+// underlying buffer alive.
+class ObjectView {
+public:
+    ObjectView() = default;
+    explicit ObjectView(std::shared_ptr<const ObjectData> data) : data(std::move(data)) {}
+
+    std::string_view type() const { return data->type; }
+    std::string_view content() const { return std::string_view(data->bytes.get(), data->size); }
+    size_t size() const { return data->size; }
+
+private:
+    std::shared_ptr<const ObjectData> data;
+};
+
+struct ObjectInfo {
+    std::string_view type;
+    uint64_t size = 0;
+};
+
+// One tree entry; the views point into the tree object. `sha` holds the
+// raw 20-byte SHA-1 (the 40-digit hex form in trees from before the binary
+// format); hex() gives the printable form either way.
+struct TreeEntry {
+    std::string_view mode;
+    std::string_view name;
+    std::string_view sha;
+
+    bool isTree() const { return mode == "40000"; }
+    std::string hex() const;
+};
+
+// Walks the entries of a tree object in stored (name) order
+class TreeIterator {
+public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = TreeEntry;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const TreeEntry*;
+    using reference = const TreeEntry&;
+
+    TreeIterator() = default;
+    TreeIterator(const char* pos, const char* end, bool legacy)
+        : pos(pos), end(end), legacy(legacy) {
+        parse();
+    }
+
+    const TreeEntry& operator*() const { return entry; }
+    const TreeEntry* operator->() const { return &entry; }
+    TreeIterator& operator++() {
+        pos = next;
+        parse();
+        return *this;
+    }
+    bool operator==(const TreeIterator& other) const { return pos == other.pos; }
+    bool operator!=(const TreeIterator& other) const { return pos != other.pos; }
+
+private:
+    const char* pos = nullptr;
+    const char* end = nullptr;
+    const char* next = nullptr;
+    bool legacy = false;  // text-format tree
+    TreeEntry entry;
+
+    void parse();
+};
+
+class TreeView {
+public:
+    explicit TreeView(std::string_view content)
+        : data(content), legacy(!content.empty() && content.find('\0') == std::string_view::npos) {}
+    explicit TreeView(ObjectView object);
+
+    TreeIterator begin() const {
+        return TreeIterator(data.data(), data.data() + data.size(), legacy);
+    }
+    TreeIterator end() const {
+        return TreeIterator(data.data() + data.size(), data.data() + data.size(), legacy);
+    }
+
+private:
+    ObjectView object;  // empty when viewing caller-owned content
+    std::string_view data;
+    bool legacy = false;
+};
+
+// Parsed commit headers; the views point into the commit object
+class CommitView {
+public:
+    explicit CommitView(std::string_view content) { parse(content); }
+    explicit CommitView(ObjectView object);
+
+    std::string_view tree() const { return tree_sha; }
+    std::string_view parent() const { return parent_sha; }  // empty for a root commit
+    std::string_view author() const { return author_line; }
+    std::string_view message() const { return message_text; }
+    int64_t timestamp() const { return time; }
+
+private:
+    ObjectView object;
+    std::string_view tree_sha;
+    std::string_view parent_sha;
+    std::string_view author_line;
+    std::string_view message_text;
+    int64_t time = 0;
+
+    void parse(std::string_view content);
+};
+
+struct ObjectCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t budget = 0;
+};
+
+struct CheckoutStats {
+    double diff_ms = 0;
+    double remove_ms = 0;
+    double mkdir_ms = 0;
+    double write_ms = 0;
+    size_t files_written = 0;
+    uint64_t bytes_written = 0;
+    size_t paths_removed = 0;
+};
+
+struct GcResult {
+    std::string pack_name;
+    size_t objects = 0;
+    size_t deltas = 0;
+    size_t graph_commits = 0;
+};
+
+struct FsckProblem {
+    enum Kind { CORRUPT, MISSING, DANGLING } kind;
+    std::string type;    // object type ("object" when unknown), "pack" or "ref"
+    std::string sha;     // or the pack file name
+    std::string detail;  // what is wrong, or what refers to a missing object
+};
+
+struct FsckResult {
+    size_t objects = 0;  // loose files and pack entries checked
+    size_t packs = 0;
+    uint64_t bytes = 0;  // inflated
+    std::vector<FsckProblem> problems;  // corrupt, then missing, then dangling
+
+    // Dangling objects are not errors
+    bool ok() const {
+        for (const auto& problem : problems) {
+            if (problem.kind != FsckProblem::DANGLING) return false;
+        }
+        return true;
+    }
+};
+
+// Working tree state relative to the index, and of the index relative to
+// the HEAD commit
+struct StatusEntry {
+    enum Kind { ADDED, MODIFIED, DELETED } kind;
+    std::string path;
+};
+
+struct Status {
+    std::vector<StatusEntry> staged;    // index vs HEAD
+    std::vector<StatusEntry> unstaged;  // working tree vs index
+    std::vector<std::string> untracked;  // directories end in '/'
+};
+
+struct DiffLine {
+    char op;                // ' ', '-' or '+'
+    std::string_view text;  // includes the trailing newline, if any
+};
+
+struct DiffHunk {
+    size_t old_start = 0;
+    size_t old_count = 0;
+    size_t new_start = 0;
+    size_t new_count = 0;
+    std::vector<DiffLine> lines;
+};
+
+struct FileDiff {
+    std::string path;
+    StatusEntry::Kind kind;
+    bool binary = false;
+    std::vector<DiffHunk> hunks;
+};
+
+// Line diff of `a` against `b` (Myers, linear space) as unified hunks with
+// `context` lines around each change. Lines point into the inputs.
+std::vector<DiffHunk> diffLines(std::string_view a, std::string_view b, size_t context = 3);
+
+class MiniVCS;
+
+class Repository {
+public:
+    Repository();
+    ~Repository();
+    Repository(const Repository&) = delete;
+    Repository& operator=(const Repository&) = delete;
+
+    // Creates .mygit in the current directory
+    void init();
+
+    // Object database
+    ObjectView read(const std::string& sha);
+    ObjectInfo info(const std::string& sha);  // header only, no inflate
+    // A file's content in pieces; chunked files are reassembled one chunk
+    // at a time
+    void stream(const std::string& sha, const std::function<void(std::string_view)>& sink);
+    bool contains(const std::string& sha);
+    TreeView readTree(const std::string& sha);
+    CommitView readCommit(const std::string& sha);
+    std::string hashObject(const std::string& path, bool write = false);
+
+    // Snapshots and history
+    void add(const std::vector<std::string>& paths);
+    std::string writeTree();
+    std::string commit(const std::string& message);
+    std::string head();  // "" before the first commit
+
+    // Calls `visit` for each commit reachable from `start` (HEAD when empty),
+    // newest first, until it returns false. revList only reads the
+    // commit-graph where it can; log also hands over each parsed commit.
+    void revList(const std::string& start, const std::function<bool(const std::string&)>& visit);
+    void log(const std::string& start,
+             const std::function<bool(const std::string&, const CommitView&)>& visit);
+    // Only commits that changed something at or below one of `paths`
+    // (files or directories, relative to the repository root). Per-commit
+    // Bloom filters of changed paths let most commits be skipped unread.
+    void log(const std::string& start, const std::vector<std::string>& paths,
+             const std::function<bool(const std::string&, const CommitView&)>& visit);
+
+    // Only files whose stat data changed since they were staged are hashed.
+    // diff visits the unstaged changes under `paths` (everything when
+    // empty); the line views are valid during the call only.
+    Status status();
+    void diff(const std::vector<std::string>& paths, const std::function<void(const FileDiff&)>& visit);
+
+    CheckoutStats checkout(const std::string& commit_sha);
+    GcResult gc(size_t window = 10, size_t max_depth = 50);
+
+    // Re-hashes every loose and packed object in parallel, checks pack
+    // checksums and the references between objects. Setting
+    // core.verifyObjects = true also re-hashes every object read.
+    FsckResult fsck();
+
+    // Working tree monitor (inotify) that add and writeTree consult when
+    // core.fsmonitor is true, so they only visit reported paths.
+    // runFsmonitor serves in the foreground, or with `detach` forks a daemon
+    // and returns once it is listening.
+    void runFsmonitor(bool detach);
+    std::string fsmonitorStatus();  // "" when no daemon is running
+    bool stopFsmonitor();
+
+    void setJobs(size_t jobs);  // 0 = one worker per hardware thread
+    ObjectCacheStats objectCacheStats() const;
+
+private:
+    std::unique_ptr<MiniVCS> vcs;
+};
+
+}  // namespace mygit
+
+#endif
@@ -0,0 +1,540 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <filesystem>
+#include <chrono>
+#include <functional>
+#include <unistd.h>
+#include "mygit.h"
+using namespace std;
+using namespace mygit;
+namespace fs = std::filesystem;
+
+// Regression checks run by `make test`. Prints each failure and exits with
+// 1 if any check failed.
+
+static int failures = 0;
+
+static void check(bool ok, const string& name, const string& detail = "") {
+    if (ok) return;
+    failures++;
+    cerr << "FAIL " << name << (detail.empty() ? "" : ": " + detail) << "\n";
+}
+
+// Runs `body` in a new temporary directory, which is removed afterwards
+static void inTempDir(const function<void()>& body) {
+    string tmpl = (fs::temp_directory_path() / "mygit-test-XXXXXX").string();
+    if (!mkdtemp(tmpl.data())) throw runtime_error("Cannot create test directory");
+    fs::path original = fs::current_path();
+    fs::current_path(tmpl);
+    try {
+        body();
+    } catch (...) {
+        fs::current_path(original);
+        fs::remove_all(tmpl);
+        throw;
+    }
+    fs::current_path(original);
+    fs::remove_all(tmpl);
+}
+
+static void writeFile(const string& path, const string& content) {
+    fs::path parent = fs::path(path).parent_path();
+    if (!parent.empty()) fs::create_directories(parent);
+    ofstream(path, ios::binary | ios::trunc) << content;
+}
+
+// Hunks in `diff -u` form, as `mygit diff` prints them
+static string unified(const vector<DiffHunk>& hunks) {
+    auto range = [](size_t start, size_t count) {
+        return to_string(start) + (count != 1 ? "," + to_string(count) : "");
+    };
+    string out;
+    for (const auto& hunk : hunks) {
+        out += "@@ -" + range(hunk.old_start, hunk.old_count) + " +" + range(hunk.new_start, hunk.new_count) +
+               " @@\n";
+        for (const auto& line : hunk.lines) {
+            out += line.op;
+            out += line.text;
+            if (line.text.empty() || line.text.back() != '\n') out += "\n\\ No newline at end of file\n";
+        }
+    }
+    return out;
+}
+
+static void checkDiff(const string& name, const string& a, const string& b, const string& expected) {
+    string got = unified(diffLines(a, b));
+    check(got == expected, "diffLines " + name, "expected\n" + expected + "got\n" + got);
+}
+
+static string numbered(int from, int to) {
+    string text;
+    for (int i = from; i <= to; i++) text += to_string(i) + "\n";
+    return text;
+}
+
+static void testDiffLines() {
+    checkDiff("empty", "", "", "");
+    checkDiff("identical", "a\nb\nc\n", "a\nb\nc\n", "");
+    checkDiff("added to empty", "", "x\ny\n", "@@ -0,0 +1,2 @@\n+x\n+y\n");
+    checkDiff("disjoint", "a\nb\n", "c\nd\n", "@@ -1,2 +1,2 @@\n-a\n-b\n+c\n+d\n");
+    checkDiff("prefix only", numbered(1, 10), "0\n" + numbered(1, 10), "@@ -1,3 +1,4 @@\n+0\n 1\n 2\n 3\n");
+    checkDiff("suffix only", numbered(1, 10), numbered(1, 11), "@@ -8,3 +8,4 @@\n 8\n 9\n 10\n+11\n");
+    checkDiff("two hunks", numbered(1, 20), "1\n2\nx\n" + numbered(4, 17) + "y\n19\n20\n",
+              "@@ -1,6 +1,6 @@\n 1\n 2\n-3\n+x\n 4\n 5\n 6\n"
+              "@@ -15,6 +15,6 @@\n 15\n 16\n 17\n-18\n+y\n 19\n 20\n");
+    checkDiff("no trailing newline", "a\nb", "a\nc",
+              "@@ -1,2 +1,2 @@\n a\n-b\n\\ No newline at end of file\n+c\n\\ No newline at end of file\n");
+    checkDiff("newline added", "a\nb", "a\nb\n",
+              "@@ -1,2 +1,2 @@\n a\n-b\n\\ No newline at end of file\n+b\n");
+}
+
+// Similar files packed by gc come back deltified; each must read back
+// byte for byte from a fresh Repository (no object cache)
+static void testDeltaRoundTrip() {
+    vector<string> contents;
+    string base;
+    for (int i = 0; i < 400; i++) base += "line " + to_string(i) + " of a file that gc should deltify\n";
+    for (int version = 0; version < 8; version++) {
+        string text = base;
+        text.replace(version * 1000, 10, "edit " + to_string(version) + "    ");  // copy, insert, copy
+        text.insert(text.size() / 2, "inserted in version " + to_string(version) + "\n");
+        if (version % 2) text += "appended tail\n";
+        contents.push_back(text);
+    }
+    contents.push_back(base.substr(0, 3000));  // target shorter than its base
+
+    vector<string> shas;
+    {
+        Repository repo;
+        repo.init();
+        for (size_t i = 0; i < contents.size(); i++) {
+            string name = "file" + to_string(i) + ".txt";
+            writeFile(name, contents[i]);
+            shas.push_back(repo.hashObject(name, true));
+        }
+        repo.add({"."});
+        repo.commit("versions");
+        GcResult gc = repo.gc();
+        check(gc.deltas > 0, "gc deltas", to_string(gc.deltas) + " of " + to_string(gc.objects) + " objects");
+    }
+    {
+        Repository repo;
+        for (size_t i = 0; i < contents.size(); i++) {
+            ObjectView object = repo.read(shas[i]);
+            check(object.type() == "blob" && object.content() == contents[i], "delta round trip",
+                  "file" + to_string(i) + ".txt");
+        }
+        FsckResult fsck = repo.fsck();
+        check(fsck.ok(), "fsck after gc", to_string(fsck.problems.size()) + " problems");
+    }
+}
+
+static string readFile(const string& path) {
+    ifstream in(path, ios::binary);
+    return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+// Moves a file's mtime an hour back, out of the racy window where the
+// stat cache re-hashes it anyway
+static void age(const string& path) {
+    fs::last_write_time(path, fs::file_time_type::clock::now() - chrono::hours(1));
+}
+
+// Tree of the working directory as a brand-new repository sees it: no
+// index, no stat cache, no cache-tree
+static string treeFromScratch() {
+    fs::path work = fs::current_path();
+    fs::path scratch = work.parent_path() / "scratch";
+    fs::remove_all(scratch);
+    fs::create_directory(scratch);
+    for (const auto& entry : fs::directory_iterator(work)) {
+        if (entry.path().filename() == ".mygit") continue;
+        fs::copy(entry.path(), scratch / entry.path().filename(), fs::copy_options::recursive);
+    }
+    fs::current_path(scratch);
+    string tree;
+    {
+        Repository repo;
+        repo.init();
+        tree = repo.writeTree();
+    }
+    fs::current_path(work);
+    fs::remove_all(scratch);
+    return tree;
+}
+
+static bool hasEntry(const vector<StatusEntry>& entries, StatusEntry::Kind kind, const string& path) {
+    for (const auto& entry : entries) {
+        if (entry.kind == kind && entry.path == path) return true;
+    }
+    return false;
+}
+
+// Edits that keep size (and even mtime) must still be noticed by the stat
+// cache, both in the Repository that staged the files and in a new one
+// that loads the index from disk
+static void testStatCache() {
+    fs::create_directory("work");
+    fs::current_path("work");
+    Repository repo;
+    repo.init();
+    writeFile("a.txt", "one\n");
+    writeFile("d/e/f.txt", "deep\n");
+    writeFile("d/g.txt", "sibling\n");
+    repo.add({"."});
+    string first = repo.commit("first");
+    check(repo.status().unstaged.empty(), "stat cache clean after commit");
+
+    // Same size, right after the index write (mtime not older than the index)
+    writeFile("a.txt", "two\n");
+    check(hasEntry(repo.status().unstaged, StatusEntry::MODIFIED, "a.txt"), "stat cache racy edit");
+    string tree = repo.writeTree();
+    check(tree == treeFromScratch(), "stat cache racy edit tree");
+    check(tree != repo.readCommit(first).tree(), "stat cache racy edit changes tree");
+
+    // Same size and the old mtime put back, on a file old enough that only
+    // its ctime can tell
+    age("d/e/f.txt");
+    repo.add({"."});
+    check(repo.status().unstaged.empty(), "stat cache clean after aging");
+    auto mtime = fs::last_write_time("d/e/f.txt");
+    writeFile("d/e/f.txt", "DEEP\n");
+    fs::last_write_time("d/e/f.txt", mtime);
+    check(hasEntry(repo.status().unstaged, StatusEntry::MODIFIED, "d/e/f.txt"), "stat cache restored mtime");
+    {
+        Repository reopened;
+        check(hasEntry(reopened.status().unstaged, StatusEntry::MODIFIED, "d/e/f.txt"),
+              "stat cache restored mtime, reopened");
+        check(reopened.writeTree() == treeFromScratch(), "stat cache restored mtime tree");
+    }
+
+    // Removed, added and appended files
+    fs::remove("d/g.txt");
+    writeFile("new/h.txt", "new\n");
+    writeFile("a.txt", "two, longer\n");
+    repo.add({"."});
+    check(repo.status().unstaged.empty(), "stat cache clean after add");
+    check(repo.writeTree() == treeFromScratch(), "stat cache edits tree");
+    fs::current_path("..");
+}
+
+// SHA of the entry at a slash-separated path below a tree, "" when absent
+static string entryAt(Repository& repo, string tree, const string& path) {
+    size_t pos = 0;
+    while (pos <= path.size()) {
+        size_t slash = min(path.find('/', pos), path.size());
+        string name = path.substr(pos, slash - pos), found;
+        for (const auto& entry : repo.readTree(tree)) {
+            if (entry.name == name) found = entry.hex();
+        }
+        if (found.empty() || slash == path.size()) return found;
+        tree = found;
+        pos = slash + 1;
+    }
+    return "";
+}
+
+// write-tree reuses the cached SHA of every directory nothing under has
+// changed; the result must still match a from-scratch tree, and only the
+// directories along an edited path may get new SHAs. Files are aged and
+// each step opens the repository afresh, so the stat cache trusts them and
+// the cache-tree read from the index is what decides.
+static void testCacheTree() {
+    fs::create_directory("work");
+    fs::current_path("work");
+    auto put = [](const string& path, const string& content) {
+        writeFile(path, content);
+        age(path);
+    };
+    for (const string dir : {"src/core", "src/util", "docs"}) {
+        for (int i = 0; i < 3; i++) put(dir + "/file" + to_string(i), dir + " " + to_string(i) + "\n");
+    }
+    string before;
+    {
+        Repository repo;
+        repo.init();
+        repo.add({"."});
+        before = repo.writeTree();
+    }
+    check(before == treeFromScratch(), "cache tree first write");
+
+    put("src/core/file1", "edited\n");
+    {
+        Repository repo;
+        repo.add({"src/core/file1"});
+    }
+    {
+        Repository repo;
+        string after = repo.writeTree();
+        check(after == treeFromScratch(), "cache tree after edit");
+        check(entryAt(repo, after, "src/core") != entryAt(repo, before, "src/core"), "cache tree edited dir");
+        check(entryAt(repo, after, "src/util") == entryAt(repo, before, "src/util"), "cache tree sibling kept");
+        check(entryAt(repo, after, "docs") == entryAt(repo, before, "docs"), "cache tree other dir kept");
+    }
+
+    // A new directory and a removed one
+    put("src/new/deep/file", "new\n");
+    fs::remove_all("docs");
+    {
+        Repository repo;
+        repo.add({"."});
+    }
+    {
+        Repository repo;
+        string tree = repo.writeTree();
+        check(tree == treeFromScratch(), "cache tree new and removed dirs");
+        check(entryAt(repo, tree, "docs").empty(), "cache tree removed dir");
+        check(!entryAt(repo, tree, "src/new/deep/file").empty(), "cache tree added dir");
+    }
+
+    // Edited without add: writeTree notices through the stat cache
+    put("src/util/file2", "changed behind the index\n");
+    {
+        Repository repo;
+        check(repo.writeTree() == treeFromScratch(), "cache tree unstaged edit");
+    }
+    fs::current_path("..");
+}
+
+// Checkout only applies the difference between HEAD and the target, so
+// the working tree must end up exactly as the target commit describes it
+// whichever commit it starts from, including after a commit made on a
+// detached HEAD
+static void testCheckout() {
+    Repository repo;
+    repo.init();
+    writeFile("a.txt", "v1\n");
+    writeFile("d/b.txt", "bee\n");
+    writeFile("d/e/c.txt", "cee\n");
+    repo.add({"."});
+    string c1 = repo.commit("first");
+
+    writeFile("a.txt", "v2\n");
+    fs::remove_all("d/b.txt");
+    writeFile("new/n.txt", "new\n");
+    repo.add({"."});
+    string c2 = repo.commit("second");
+    writeFile("untracked.txt", "mine\n");
+
+    repo.checkout(c1);
+    check(readFile("a.txt") == "v1\n" && readFile("d/b.txt") == "bee\n" && readFile("d/e/c.txt") == "cee\n",
+          "checkout back to first");
+    check(!fs::exists("new/n.txt"), "checkout removes added file");
+    check(readFile("untracked.txt") == "mine\n", "checkout keeps untracked file");
+    check(repo.status().unstaged.empty(), "checkout leaves a clean index");
+
+    repo.checkout(c2);
+    check(readFile("a.txt") == "v2\n" && !fs::exists("d/b.txt") && readFile("new/n.txt") == "new\n",
+          "checkout forward to second");
+
+    // Commit on a detached HEAD, then return to the commit it grew from
+    repo.checkout(c1);
+    writeFile("a.txt", "v3\n");
+    repo.add({"a.txt"});
+    string c3 = repo.commit("detached");
+    check(repo.head() == c3, "detached commit moves HEAD");
+    check(repo.readCommit(c3).parent() == c1, "detached commit parent");
+    repo.checkout(c1);
+    check(readFile("a.txt") == "v1\n", "checkout after detached commit");
+    repo.checkout(c3);
+    check(readFile("a.txt") == "v3\n", "checkout of detached commit");
+    {
+        Repository reopened;
+        reopened.checkout(c2);
+    }
+    check(readFile("a.txt") == "v2\n" && readFile("new/n.txt") == "new\n", "checkout from detached commit");
+}
+
+// In batch fsync mode (the default) written objects wait in temp files
+// for the next flush; until then contains, info, read and stream must all
+// find them. A failed flush must leave nothing behind that blocks a retry.
+static void testPendingObjects() {
+    string content = "written but not yet flushed\n";
+    writeFile("pending.txt", content);
+    string sha;
+    {
+        Repository repo;
+        repo.init();
+        sha = repo.hashObject("pending.txt", true);
+        check(repo.contains(sha), "pending contains");
+        check(repo.info(sha).type == "blob" && repo.info(sha).size == content.size(), "pending info");
+        check(repo.read(sha).content() == content, "pending read");
+        string streamed;
+        repo.stream(sha, [&](string_view piece) { streamed += piece; });
+        check(streamed == content, "pending stream");
+    }
+    {
+        Repository repo;
+        check(repo.contains(sha) && repo.read(sha).content() == content, "pending flushed on close");
+    }
+
+    // A file where the object's fan-out directory belongs makes the rename fail
+    writeFile("blocked.txt", "cannot be renamed into place\n");
+    string blocked;
+    {
+        Repository repo;
+        blocked = repo.hashObject("blocked.txt");
+    }
+    string fanout = ".mygit/objects/" + blocked.substr(0, 2);
+    fs::remove_all(fanout);
+    writeFile(fanout, "");
+    {
+        Repository repo;
+        bool threw = false;
+        try {
+            repo.add({"blocked.txt"});
+        } catch (const runtime_error&) {
+            threw = true;
+        }
+        check(threw, "failed flush reported");
+        fs::remove(fanout);
+        check(!repo.contains(blocked), "failed flush forgets the object");
+        repo.add({"blocked.txt"});
+    }
+    {
+        Repository repo;
+        check(repo.contains(blocked) && repo.read(blocked).content() == "cannot be renamed into place\n",
+              "retry after failed flush");
+    }
+    size_t temps = 0;
+    for (const auto& entry : fs::recursive_directory_iterator(".mygit/objects")) {
+        if (entry.is_regular_file() && entry.path().filename().string().rfind("tmp", 0) == 0) temps++;
+    }
+    check(temps == 0, "failed flush leaves no temp files", to_string(temps));
+}
+
+// Twenty commits, each rewriting one file of a small tree spread over a
+// few directories; returns them oldest first
+static vector<string> makeHistory(Repository& repo) {
+    repo.init();
+    vector<string> commits;
+    for (int i = 0; i < 20; i++) {
+        string path = "dir" + to_string(i % 3) + "/sub" + to_string(i % 2) + "/file" + to_string(i % 4);
+        writeFile(path, "commit " + to_string(i) + "\n");
+        repo.add({"."});
+        commits.push_back(repo.commit("change " + to_string(i)));
+    }
+    return commits;
+}
+
+static void dropCommitGraph() {
+    fs::remove(".mygit/objects/info/commit-graph");
+    fs::remove(".mygit/objects/info/commit-graph-bloom");
+}
+
+// rev-list and log answer from the commit-graph where they can; both must
+// give the same commits and headers as walking the commit objects
+static void testCommitGraph() {
+    vector<string> commits;
+    vector<string> with_graph, messages;
+    {
+        Repository repo;
+        commits = makeHistory(repo);
+        repo.gc();
+        repo.revList("", [&](const string& sha) {
+            with_graph.push_back(sha);
+            return true;
+        });
+        repo.log("", [&](const string& sha, const CommitView& commit) {
+            messages.push_back(sha + " " + string(commit.tree()) + " " + string(commit.message()));
+            return true;
+        });
+    }
+    check(with_graph == vector<string>(commits.rbegin(), commits.rend()), "commit graph rev-list");
+
+    dropCommitGraph();
+    vector<string> without_graph, plain_messages;
+    {
+        Repository repo;
+        repo.revList("", [&](const string& sha) {
+            without_graph.push_back(sha);
+            return true;
+        });
+        repo.log("", [&](const string& sha, const CommitView& commit) {
+            plain_messages.push_back(sha + " " + string(commit.tree()) + " " + string(commit.message()));
+            return true;
+        });
+        vector<string> partial;
+        repo.revList(commits[5], [&](const string& sha) {
+            partial.push_back(sha);
+            return partial.size() < 3;
+        });
+        check(partial == vector<string>{commits[5], commits[4], commits[3]}, "rev-list from a commit, stopped");
+    }
+    check(without_graph == with_graph, "rev-list with and without commit graph");
+    check(plain_messages == messages, "log with and without commit graph");
+}
+
+// Path-limited log skips most commits on their Bloom filters alone; it
+// must list exactly the commits whose tree changed at or below a path,
+// found here by comparing each commit's tree with its parent's
+static void testPathLog() {
+    Repository repo;
+    vector<string> commits = makeHistory(repo);
+    const vector<vector<string>> queries = {
+        {"dir0/sub0/file0"}, {"dir1"}, {"dir2/sub1"}, {"dir0/sub1/file1", "dir2/sub0"}, {"missing"}, {"dir"},
+    };
+
+    auto expected = [&](const vector<string>& paths) {
+        vector<string> out;
+        for (size_t i = commits.size(); i-- > 0;) {
+            string tree(repo.readCommit(commits[i]).tree());
+            string parent = i ? string(repo.readCommit(commits[i - 1]).tree()) : "";
+            for (const auto& path : paths) {
+                if (entryAt(repo, tree, path) != (parent.empty() ? "" : entryAt(repo, parent, path))) {
+                    out.push_back(commits[i]);
+                    break;
+                }
+            }
+        }
+        return out;
+    };
+    auto logged = [](Repository& from, const vector<string>& paths) {
+        vector<string> out;
+        from.log("", paths, [&](const string& sha, const CommitView&) {
+            out.push_back(sha);
+            return true;
+        });
+        return out;
+    };
+
+    for (const auto& paths : queries) {
+        check(logged(repo, paths) == expected(paths), "path log " + paths[0] + " with Bloom filters");
+    }
+    repo.gc();
+    for (const auto& paths : queries) {
+        check(logged(repo, paths) == expected(paths), "path log " + paths[0] + " after gc");
+    }
+    dropCommitGraph();
+    {
+        Repository plain;
+        for (const auto& paths : queries) {
+            check(logged(plain, paths) == expected(paths), "path log " + paths[0] + " without commit graph");
+        }
+    }
+}
+
+int main() {
+    try {
+        testDiffLines();
+        inTempDir(testDeltaRoundTrip);
+        inTempDir(testStatCache);
+        inTempDir(testCacheTree);
+        inTempDir(testCheckout);
+        inTempDir(testPendingObjects);
+        inTempDir(testCommitGraph);
+        inTempDir(testPathLog);
+    } catch (const exception& e) {
+        cerr << "Error: " << e.what() << endl;
+        return 1;
+    }
+    if (failures) {
+        cerr << failures << " check(s) failed\n";
+        return 1;
+    }
+    cout << "All tests passed\n";
+    return 0;
+}